@@ -19,6 +19,20 @@
 #include <common.h>
 
 void cpu_exec(uint64_t n);
+void cpu_set_trace(bool enable);
+void cpu_fast_forward(uint64_t nr_inst, vaddr_t pc, bool stop);
+void cpu_set_break(bool enable);
+bool cpu_break_at(vaddr_t pc);
+// the breakpoints set by sdb
+bool bp_exist(vaddr_t pc);
+bool bp_check(vaddr_t pc);
+
+#ifdef CONFIG_ENGINE_THREADED
+void tcache_exec(uint64_t n);
+void tcache_invalidate(paddr_t page);
+void tcache_flush();
+void tcache_set_stop(vaddr_t pc);
+#endif
 
 void set_nemu_state(int state, vaddr_t pc, int halt_ret);
 void invalid_inst(vaddr_t thispc);
@@ -23,7 +23,6 @@ typedef struct Decode {
   vaddr_t snpc; // static next pc
   vaddr_t dnpc; // dynamic next pc
   ISADecodeInfo isa;
-  IFDEF(CONFIG_ITRACE, char logbuf[128]);
 } Decode;
 
 // --- pattern matching mechanism ---
@@ -87,6 +86,33 @@ finish:
 
 
 // --- pattern matching wrappers for decode ---
+#if defined(__INSTPAT_GEN__)
+// Only emit the patterns so that tools/gen-decode can build the decode trees.
+// The trees do not exist yet, so do not let the ISA include them.
+#undef CONFIG_DECODE_TREE
+#define INSTPAT(pattern, name, ...) __instpat__(pattern, #name, __LINE__)
+#define INSTPAT_START(name) __instpat_start__(name)
+#define INSTPAT_END(name)   __instpat_end__(name)
+
+#elif defined(CONFIG_DECODE_TREE)
+// The decode tree generated by tools/gen-decode returns the line of the
+// first matching pattern in the table, which selects the matched body. The
+// tree is checked to know the line of every pattern, so that a stale tree
+// fails to build instead of running the wrong body. Two patterns on one
+// line are rejected as duplicate case labels.
+#define INSTPAT(pattern, ...) \
+  case __LINE__: { \
+    static_assert(__instpat_line_ok(__LINE__), "the decode tree is stale"); \
+    INSTPAT_MATCH(s, ##__VA_ARGS__); \
+    goto *(__instpat_end); \
+  }
+
+#define INSTPAT_START(name) { \
+  static const void *const __instpat_end = &&concat(__instpat_end_, name); \
+  switch (concat(__instpat_tree_, name)(INSTPAT_INST(s))) {
+#define INSTPAT_END(name)   default: ; } concat(__instpat_end_, name): ; }
+
+#else
 #define INSTPAT(pattern, ...) do { \
   uint64_t key, mask, shift; \
   pattern_decode(pattern, STRLEN(pattern), &key, &mask, &shift); \
@@ -96,7 +122,10 @@ finish:
   } \
 } while (0)
 
-#define INSTPAT_START(name) { const void ** __instpat_end = &&concat(__instpat_end_, name);
+// `__instpat_end` is static so that an ISA may jump directly into a matched
+// body (e.g. from a decode cache) without passing through INSTPAT_START
+#define INSTPAT_START(name) { static const void *const __instpat_end = &&concat(__instpat_end_, name);
 #define INSTPAT_END(name)   concat(__instpat_end_, name): ; }
+#endif
 
 #endif
@@ -16,9 +16,15 @@
 #ifndef __DEVICE_ALARM_H__
 #define __DEVICE_ALARM_H__
 
+#include <stdatomic.h>
+
 #define TIMER_HZ 60
 
 typedef void (*alarm_handler_t) ();
 void add_alarm_handle(alarm_handler_t h);
 
+// set when a tick is due, then device_update() calls alarm_run()
+extern atomic_bool alarm_pending;
+void alarm_run();
+
 #endif
@@ -0,0 +1,42 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#ifndef __DEVICE_EVENT_H__
+#define __DEVICE_EVENT_H__
+
+#include <common.h>
+
+/* Devices schedule timed work as events on a queue ordered by the guest
+ * time, see src/device/event.c. An Event is owned by its device and is
+ * usually a static variable. Set `period` (in us) to make it fire again
+ * `period` after each time it fires.
+ */
+
+typedef void (*event_handler_t) ();
+
+typedef struct {
+  event_handler_t handler;
+  uint64_t period;
+  uint64_t when;  // the guest time to fire
+  int idx;        // the position in the queue, 0 if it is not scheduled
+} Event;
+
+// fire `e` at `delay` us of guest time from now
+void event_schedule(Event *e, uint64_t delay);
+void event_cancel(Event *e);
+// fire the events due at `now`, and return the time of the next one
+uint64_t event_run(uint64_t now);
+
+#endif
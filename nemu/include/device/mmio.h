@@ -20,5 +20,9 @@
 
 word_t mmio_read(paddr_t addr, int len);
 void mmio_write(paddr_t addr, int len, word_t data);
+// the range of the map named `name`, return false if there is none
+bool mmio_find_map(const char *name, paddr_t *low, paddr_t *high);
+// the dirty flags of the MMIO page containing `addr`, NULL if it is not mapped
+uint8_t* mmio_dirty_flags(paddr_t addr);
 
 #endif
@@ -32,10 +32,33 @@ void init_isa();
 extern CPU_state cpu;
 void isa_reg_display();
 word_t isa_reg_str2val(const char *name, bool *success);
+// the location of the register in `cpu`, NULL if there is no such register
+word_t *isa_reg_str2ptr(const char *name);
 
 // exec
 struct Decode;
 int isa_exec_once(struct Decode *s);
+// tell the function calls and returns of the executed instruction, for ftrace
+bool isa_inst_is_call(struct Decode *s);
+bool isa_inst_is_ret(struct Decode *s);
+#ifdef CONFIG_DECODE_CACHE
+void isa_dcache_flush();
+void isa_dcache_invalidate(paddr_t page);
+#endif
+#ifdef CONFIG_ENGINE_THREADED
+// decode without executing, return true if it is the last one of a basic block
+bool isa_decode_once(struct Decode *s);
+int isa_exec_block(struct Decode *s, int n);
+void isa_exec_block_stop();
+#endif
+#ifdef CONFIG_TCACHE_FUSION
+void isa_fuse_block(struct Decode *s, int n);
+#endif
+#ifdef CONFIG_TCACHE_JIT
+// return NULL if the code cache is full
+void *isa_jit_translate(struct Decode *s, int n);
+void isa_jit_reset();
+#endif
 
 // memory
 enum { MMU_DIRECT, MMU_TRANSLATE, MMU_FAIL };
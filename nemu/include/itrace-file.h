@@ -0,0 +1,95 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#ifndef __ITRACE_FILE_H__
+#define __ITRACE_FILE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* The format of the file written by --itrace, which is shared with
+ * tools/itrace-dump, so it does not depend on the configuration.
+ *
+ *   ItraceFileHeader
+ *   { ItraceBlockHeader, compressed records } ...
+ *   ItraceIndexEntry[nr_block]
+ *   function names, each terminated by '\0'
+ *   ItraceFileFooter
+ *
+ * A block holds at most ITRACE_BLOCK_RECORDS records, compressed by
+ * lz_compress() unless that does not make it smaller. The index maps the
+ * first instruction of each block to its offset, so that a reader can
+ * seek to an instruction by decompressing one block.
+ *
+ * Besides the instructions, the calls and returns seen by ftrace are
+ * recorded in the same stream. They are numbered by the instruction
+ * making them, and refer to the functions by their index in the names.
+ */
+
+#define ITRACE_FILE_MAGIC "NEMUITR"
+#define ITRACE_FILE_VERSION 2
+#define ITRACE_BLOCK_RECORDS 2048
+#define ITRACE_MAX_ILEN 16
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t record_size;
+  char isa[16];   // the guest ISA, e.g. "riscv32"
+} ItraceFileHeader;
+
+enum { ITRACE_REC_INST, ITRACE_REC_CALL, ITRACE_REC_RET };
+
+typedef struct {
+  uint64_t pc;
+  uint32_t delta; // the instruction number minus the one of the previous
+                  // record, ignored for the first record of a block
+  uint8_t kind;
+  uint8_t ilen;
+  uint8_t pad[2];
+  union {
+    uint8_t inst[ITRACE_MAX_ILEN];  // ITRACE_REC_INST
+    struct {
+      uint64_t target;              // the next pc
+      uint32_t func;                // the callee, or the function returning
+    } fn;                           // ITRACE_REC_CALL and ITRACE_REC_RET
+  };
+} ItraceRecord;
+
+typedef struct {
+  uint64_t first_inst; // the instruction number of the first record
+  uint32_t nr_record;
+  uint32_t size;       // the records are stored as is if it is their size
+} ItraceBlockHeader;
+
+typedef struct {
+  uint64_t first_inst;
+  uint64_t offset;     // of the ItraceBlockHeader
+} ItraceIndexEntry;
+
+typedef struct {
+  uint64_t index_offset;
+  uint64_t nr_block;
+  uint64_t func_offset;
+  uint64_t nr_func;
+  char magic[8];
+} ItraceFileFooter;
+
+// return the compressed size, or 0 if it does not fit in `cap` bytes
+size_t lz_compress(const void *src, size_t len, void *dst, size_t cap);
+// return the decompressed size, or (size_t)-1 if `src` is broken
+size_t lz_decompress(const void *src, size_t len, void *dst, size_t cap);
+
+#endif
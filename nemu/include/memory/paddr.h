@@ -31,7 +31,39 @@ static inline bool in_pmem(paddr_t addr) {
   return addr - CONFIG_MBASE < CONFIG_MSIZE;
 }
 
+// make pmem in [addr, addr + len) ready to be written by the host kernel
+void pmem_commit(paddr_t addr, size_t len);
+/* load [off, off + len) of the file `fd` to pmem at `addr`, or zeros if `fd` < 0;
+ * with PMEM_MMAP, the whole pages are mapped copy-on-write instead of read */
+void pmem_load(paddr_t addr, size_t len, int fd, off_t off);
+
 word_t paddr_read(paddr_t addr, int len);
 void paddr_write(paddr_t addr, int len, word_t data);
 
+/* Dirty page tracking over pmem and the MMIO space. Each client owns one bit
+ * of the dirty flags of a page, which is set by a write to the page through
+ * paddr_write(), and cleared by the client with paddr_dirty_clear().
+ *
+ * DIRTY_CODE is cleared when the page holds cached or translated code,
+ * and the code is invalidated when the page is written.
+ * DIRTY_WATCH is cleared by paddr_watch_page(), and is not set by writes.
+ * DIRTY_VGA is cleared when the pages of vmem are uploaded to the screen.
+ */
+enum { DIRTY_CODE, DIRTY_DIFFTEST, DIRTY_WATCH, DIRTY_VGA, NR_DIRTY_CLIENT };
+#define DIRTY_BIT(client) (1u << (client))
+#define DIRTY_ALL 0xff
+
+// whether any page in [addr, addr + len) is dirty for `client`
+bool paddr_dirty_test(paddr_t addr, size_t len, int client);
+void paddr_dirty_clear(paddr_t addr, size_t len, int client);
+// mark [addr, addr + len) as dirty after it is written by the host, e.g. by memcpy()
+void paddr_dirty_set(paddr_t addr, size_t len);
+// one byte of dirty flags per page of pmem
+const uint8_t *paddr_dirty_map();
+
+/* watch the page of pmem containing `addr`, every write to a watched page is
+ * passed to the handler before it is performed */
+void paddr_watch_page(paddr_t addr, bool watch);
+void paddr_set_watch_handler(void (*handler)(paddr_t addr, int len, word_t data));
+
 #endif
@@ -21,6 +21,10 @@
 word_t vaddr_ifetch(vaddr_t addr, int len);
 word_t vaddr_read(vaddr_t addr, int len);
 void vaddr_write(vaddr_t addr, int len, word_t data);
+// translate `addr` for an access of `type`, see MEM_TYPE_* in isa.h
+paddr_t vaddr_to_paddr(vaddr_t addr, int type);
+// drop all cached translations, e.g. when the page table is changed
+void tlb_flush();
 
 #define PAGE_SHIFT        12
 #define PAGE_SIZE         (1ul << PAGE_SHIFT)
@@ -33,6 +33,8 @@ extern NEMUState nemu_state;
 // ----------- timer -----------
 
 uint64_t get_time();
+// the time seen by the guest (unit: us)
+uint64_t get_guest_time();
 
 // ----------- log -----------
 
@@ -56,22 +58,71 @@ uint64_t get_time();
 
 #define ANSI_FMT(str, fmt) fmt str ANSI_NONE
 
+// the log is written asynchronously, see src/utils/log.c
+void log_printf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+void log_stdout(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+void log_flush();
+
 #define log_write(...) IFDEF(CONFIG_TARGET_NATIVE_ELF, \
   do { \
     extern FILE* log_fp; \
     extern bool log_enable(); \
     if (log_enable() && log_fp != NULL) { \
-      fprintf(log_fp, __VA_ARGS__); \
-      fflush(log_fp); \
+      IFDEF(CONFIG_ITRACE, itrace_flush()); \
+      log_printf(__VA_ARGS__); \
     } \
   } while (0) \
 )
 
+// the line goes to stdout, and also to the log file if it is not stdout
 #define _Log(...) \
   do { \
-    printf(__VA_ARGS__); \
-    log_write(__VA_ARGS__); \
+    MUXDEF(CONFIG_TARGET_AM, printf(__VA_ARGS__), _log_stdout(__VA_ARGS__)); \
   } while (0)
 
+#define _log_stdout(...) \
+  do { \
+    extern FILE* log_fp; \
+    IFDEF(CONFIG_ITRACE, if (log_fp == stdout) itrace_flush()); \
+    log_stdout(__VA_ARGS__); \
+    if (log_fp != stdout) log_write(__VA_ARGS__); \
+  } while (0)
+
+// ----------- itrace -----------
+
+#ifdef CONFIG_ITRACE
+void itrace_record(vaddr_t pc, const void *inst, int ilen, bool log);
+void itrace_format(char *buf, int size, vaddr_t pc, const uint8_t *inst, int ilen);
+void itrace_flush();
+void itrace_dump_ring();
+
+extern bool itrace_file_on;
+void itrace_file_write(uint64_t nr_inst, vaddr_t pc, const void *inst, int ilen);
+void itrace_file_func(uint64_t nr_inst, bool is_call, vaddr_t pc, vaddr_t target, int func);
+void close_itrace_file();
+#endif
+
+// ----------- mtrace -----------
+
+#ifdef CONFIG_MTRACE
+// one data access, written to the mtrace file as is
+typedef struct {
+  uint64_t pc;
+  uint64_t addr;    // physical address
+  uint64_t data;
+  uint8_t len;
+  uint8_t is_write;
+  uint8_t pad[6];
+} MTraceRecord;
+
+extern bool mtrace_on;
+void mtrace_record(vaddr_t pc, paddr_t addr, int len, word_t data, bool is_write);
+// SPEC is LOW-HIGH of physical addresses or the name of a device, return false if it is invalid
+bool mtrace_add_filter(const char *spec);
+void mtrace_clear_filter();
+void mtrace_display_filter();
+void close_mtrace();
+#endif
+
 
 #endif
@@ -34,13 +34,27 @@ static bool g_print_step = false;
 void device_update();
 
 uint8_t detect_wp_change(CWP** vec_wp);
-int find_stat(vaddr_t pc, vaddr_t snpc);
+int find_stat(vaddr_t pc, vaddr_t snpc, struct Decode *s);
+
+// an extra condition of the itrace log set by sdb, compiled by expr_compile()
+static Expr *itrace_cond = NULL;
+
+void cpu_set_itrace_cond(Expr *cond) {
+  expr_free(itrace_cond);
+  itrace_cond = cond;
+}
 
 static void trace_and_difftest(Decode *_this, vaddr_t dnpc) {
-#ifdef CONFIG_ITRACE_COND
-  if (ITRACE_COND) { log_write("%s\n", _this->logbuf); }
+#ifdef CONFIG_ITRACE
+  extern bool log_enable();
+  bool log = log_enable() && ITRACE_COND && (itrace_cond == NULL || expr_eval(itrace_cond));
+  itrace_record(_this->pc, &_this->isa.inst, _this->snpc - _this->pc, log);
+  if (g_print_step) {
+    char buf[128];
+    itrace_format(buf, sizeof(buf), _this->pc, (uint8_t *)&_this->isa.inst, _this->snpc - _this->pc);
+    log_stdout("%s\n", buf);
+  }
 #endif
-  if (g_print_step) { IFDEF(CONFIG_ITRACE, puts(_this->logbuf)); }
   IFDEF(CONFIG_DIFFTEST, difftest_step(_this->pc, dnpc));
 
 #ifdef CONFIG_CC_TRACE_AND_DIFFTEST
@@ -65,47 +79,89 @@ static void trace_and_difftest(Decode *_this, vaddr_t dnpc) {
 }
 
 #ifdef CONFIG_ITRACE
-static void trace_func_call_ret(vaddr_t pc, vaddr_t dnpc) {
-  find_stat(pc, dnpc);
+static void trace_func_call_ret(vaddr_t pc, vaddr_t dnpc, Decode *s) {
+  find_stat(pc, dnpc, s);
 }
 #endif
 
-static void exec_once(Decode *s, vaddr_t pc) {
+__attribute__((always_inline))
+static inline void exec_once(Decode *s, vaddr_t pc, bool trace) {
   s->pc = pc;
   s->snpc = pc;
   isa_exec_once(s);
-  IFDEF(CONFIG_ITRACE, trace_func_call_ret(pc, s->dnpc));
   cpu.pc = s->dnpc;
-#ifdef CONFIG_ITRACE
-  char *p = s->logbuf;
-  p += snprintf(p, sizeof(s->logbuf), FMT_WORD ":", s->pc);
-  int ilen = s->snpc - s->pc;
-  int i;
-  uint8_t *inst = (uint8_t *)&s->isa.inst;
-#ifdef CONFIG_ISA_x86
-  for (i = 0; i < ilen; i ++) {
-#else
-  for (i = ilen - 1; i >= 0; i --) {
-#endif
-    p += snprintf(p, 4, " %02x", inst[i]);
+  if (!trace) return;
+  IFDEF(CONFIG_ITRACE, trace_func_call_ret(pc, s->dnpc, s));
+}
+
+/* There are two execution loops. execute_fast() runs the guest without any
+ * per-instruction hook, while execute_trace() feeds every instruction to the
+ * tracers, difftest and the watchpoints built into NEMU. Which one is used is
+ * decided at runtime, so that a long run may be fast-forwarded to the window
+ * of interest before it is traced. Fast-forwarding stops before executing the
+ * instruction at `ff_pc` or the `ff_inst`-th instruction, then tracing is
+ * turned on. By default, the run is fast-forwarded to CONFIG_TRACE_START.
+ */
+#define HAS_TRACE (ISDEF(CONFIG_ITRACE) || ISDEF(CONFIG_DIFFTEST) || ISDEF(CONFIG_CC_TRACE_AND_DIFFTEST))
+static uint64_t ff_inst = MUXDEF(CONFIG_TRACE, CONFIG_TRACE_START, 0);
+static bool g_trace = HAS_TRACE && MUXDEF(CONFIG_TRACE, CONFIG_TRACE_START, 0) == 0;
+static vaddr_t ff_pc = (vaddr_t)-1;
+static bool ff_stop = false;
+
+/* Breakpoints are only checked when at least one is set. The interpreter
+ * then switches to a copy of its loop with the check, and the threaded
+ * engine ends the blocks before them, so that only the blocks starting at
+ * a breakpoint check it. A run resumed from a breakpoint does not stop at
+ * it again before executing its instruction, even if breakpoints are added
+ * or deleted in between, unless the run is resumed from elsewhere.
+ */
+static bool g_break = false;
+static vaddr_t break_resume_pc = (vaddr_t)-1;
+
+void cpu_set_break(bool enable) {
+  g_break = enable;
+  IFDEF(CONFIG_ENGINE_THREADED, tcache_flush());
+}
+
+bool cpu_break_at(vaddr_t pc) {
+  if (pc == break_resume_pc) {
+    break_resume_pc = (vaddr_t)-1;
+    return false;
+  }
+  if (!bp_check(pc)) return false;
+  break_resume_pc = pc;
+  return true;
+}
+
+#ifndef CONFIG_ENGINE_THREADED
+__attribute__((always_inline))
+static inline void execute_fast_loop(uint64_t n, bool brk) {
+  Decode s;
+  for (;n > 0; n --) {
+    if (unlikely(cpu.pc == ff_pc)) break;
+    if (brk && cpu_break_at(cpu.pc)) break;
+    exec_once(&s, cpu.pc, false);
+    g_nr_guest_inst ++;
+    if (nemu_state.state != NEMU_RUNNING) break;
+    IFDEF(CONFIG_DEVICE, device_update());
   }
-  int ilen_max = MUXDEF(CONFIG_ISA_x86, 8, 4);
-  int space_len = ilen_max - ilen;
-  if (space_len < 0) space_len = 0;
-  space_len = space_len * 3 + 1;
-  memset(p, ' ', space_len);
-  p += space_len;
-
-  void disassemble(char *str, int size, uint64_t pc, uint8_t *code, int nbyte);
-  disassemble(p, s->logbuf + sizeof(s->logbuf) - p,
-      MUXDEF(CONFIG_ISA_x86, s->snpc, s->pc), (uint8_t *)&s->isa.inst, ilen);
+}
+#endif
+
+static void execute_fast(uint64_t n) {
+#ifdef CONFIG_ENGINE_THREADED
+  tcache_exec(n);
+#else
+  if (g_break) execute_fast_loop(n, true);
+  else execute_fast_loop(n, false);
 #endif
 }
 
-static void execute(uint64_t n) {
+static void execute_trace(uint64_t n) {
   Decode s;
   for (;n > 0; n --) {
-    exec_once(&s, cpu.pc);
+    if (g_break && cpu_break_at(cpu.pc)) break;
+    exec_once(&s, cpu.pc, true);
     g_nr_guest_inst ++;
     trace_and_difftest(&s, cpu.pc);
     if (nemu_state.state != NEMU_RUNNING) break;
@@ -113,6 +169,42 @@ static void execute(uint64_t n) {
   }
 }
 
+void cpu_set_trace(bool enable) {
+  if (enable && !g_trace) difftest_attach();
+  if (!enable && g_trace) difftest_detach();
+  g_trace = enable;
+}
+
+void cpu_fast_forward(uint64_t nr_inst, vaddr_t pc, bool stop) {
+  ff_inst = nr_inst;
+  ff_pc = pc;
+  ff_stop = stop;
+  IFDEF(CONFIG_ENGINE_THREADED, tcache_set_stop(pc));
+  cpu_set_trace(false);
+}
+
+static void execute(uint64_t n) {
+  if (!g_trace) {
+    uint64_t start = g_nr_guest_inst;
+    uint64_t m = n;
+    if (ff_inst > start && ff_inst - start < m) m = ff_inst - start;
+    execute_fast(m);
+    n -= g_nr_guest_inst - start;
+    if (nemu_state.state != NEMU_RUNNING) return;
+
+    bool reached = (ff_inst != 0 && g_nr_guest_inst >= ff_inst) || cpu.pc == ff_pc;
+    if (!reached) return;
+    Log("Fast-forward reaches pc = " FMT_WORD " after %" PRIu64 " instructions, start tracing",
+        cpu.pc, g_nr_guest_inst);
+    ff_inst = 0;
+    ff_pc = (vaddr_t)-1;
+    IFDEF(CONFIG_ENGINE_THREADED, tcache_set_stop(ff_pc));
+    cpu_set_trace(true);
+    if (ff_stop) { nemu_state.state = NEMU_STOP; return; }
+  }
+  execute_trace(n);
+}
+
 static void statistic() {
   IFNDEF(CONFIG_TARGET_AM, setlocale(LC_NUMERIC, ""));
 #define NUMBERIC_FMT MUXDEF(CONFIG_TARGET_AM, "%", "%'") PRIu64
@@ -123,6 +215,9 @@ static void statistic() {
 }
 
 void assert_fail_msg() {
+  IFDEF(CONFIG_ITRACE, itrace_dump_ring());
+  IFDEF(CONFIG_ITRACE, close_itrace_file());
+  IFDEF(CONFIG_MTRACE, close_mtrace());
   isa_reg_display();
   statistic();
 }
@@ -136,6 +231,7 @@ void cpu_exec(uint64_t n) {
       return;
     default: nemu_state.state = NEMU_RUNNING;
   }
+  if (cpu.pc != break_resume_pc) break_resume_pc = (vaddr_t)-1;
 
   uint64_t timer_start = get_time();
 
@@ -143,11 +239,14 @@ void cpu_exec(uint64_t n) {
 
   uint64_t timer_end = get_time();
   g_timer += timer_end - timer_start;
+  IFDEF(CONFIG_ITRACE, itrace_flush());
+  IFNDEF(CONFIG_TARGET_AM, log_flush());
 
   switch (nemu_state.state) {
     case NEMU_RUNNING: nemu_state.state = NEMU_STOP; break;
 
     case NEMU_END: case NEMU_ABORT:
+      if (nemu_state.state == NEMU_ABORT) { IFDEF(CONFIG_ITRACE, itrace_dump_ring()); }
       Log("nemu: %s at pc = " FMT_WORD,
           (nemu_state.state == NEMU_ABORT ? ANSI_FMT("ABORT", ANSI_FG_RED) :
            (nemu_state.halt_ret == 0 ? ANSI_FMT("HIT GOOD TRAP", ANSI_FG_GREEN) :
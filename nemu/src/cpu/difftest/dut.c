@@ -18,6 +18,7 @@
 #include <isa.h>
 #include <cpu/cpu.h>
 #include <memory/paddr.h>
+#include <memory/vaddr.h>
 #include <utils.h>
 #include <difftest-def.h>
 
@@ -30,6 +31,7 @@ void (*ref_difftest_raise_intr)(uint64_t NO) = NULL;
 
 static bool is_skip_ref = false;
 static int skip_dut_nr_inst = 0;
+static bool is_detach = false;
 
 // this is used to let ref skip instructions which
 // can not produce consistent behavior with NEMU
@@ -99,9 +101,30 @@ static void checkregs(CPU_state *ref, vaddr_t pc) {
   }
 }
 
+// stop checking, e.g. while the run is fast-forwarded
+void difftest_detach() {
+  is_detach = true;
+  paddr_dirty_clear(CONFIG_MBASE, CONFIG_MSIZE, DIRTY_DIFFTEST);
+}
+
+// the state of REF is stale after detaching, so copy the pages written since then
+void difftest_attach() {
+  is_detach = false;
+  is_skip_ref = false;
+  skip_dut_nr_inst = 0;
+  for (paddr_t page = CONFIG_MBASE; page - CONFIG_MBASE < CONFIG_MSIZE; page += PAGE_SIZE) {
+    if (paddr_dirty_test(page, PAGE_SIZE, DIRTY_DIFFTEST)) {
+      ref_difftest_memcpy(page, guest_to_host(page), PAGE_SIZE, DIFFTEST_TO_REF);
+    }
+  }
+  ref_difftest_regcpy(&cpu, DIFFTEST_TO_REF);
+}
+
 void difftest_step(vaddr_t pc, vaddr_t npc) {
   CPU_state ref_r;
 
+  if (is_detach) return;
+
   if (skip_dut_nr_inst > 0) {
     ref_difftest_regcpy(&ref_r, DIFFTEST_TO_DUT);
     if (ref_r.pc == npc) {
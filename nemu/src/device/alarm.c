@@ -15,37 +15,70 @@
 
 #include <common.h>
 #include <device/alarm.h>
-#include <sys/time.h>
-#include <signal.h>
+#include <device/event.h>
+#include <sys/timerfd.h>
+#include <pthread.h>
+#include <unistd.h>
+
+/* The handlers are called at TIMER_HZ of the host time. A helper thread
+ * waits on a timerfd and only sets `alarm_pending`, which device_update()
+ * checks on the CPU thread, so the handlers never run in a signal handler
+ * or in the middle of an instruction.
+ *
+ * With ICOUNT, the handlers follow the guest time by an event instead.
+ */
 
 #define MAX_HANDLER 8
 
 static alarm_handler_t handler[MAX_HANDLER] = {};
 static int idx = 0;
 
+atomic_bool alarm_pending = false;
+
 void add_alarm_handle(alarm_handler_t h) {
   assert(idx < MAX_HANDLER);
   handler[idx ++] = h;
 }
 
-static void alarm_sig_handler(int signum) {
+void alarm_run() {
+  atomic_store_explicit(&alarm_pending, false, memory_order_relaxed);
   int i;
   for (i = 0; i < idx; i ++) {
     handler[i]();
   }
 }
 
+#ifdef CONFIG_ICOUNT
+static Event alarm_event = { .handler = alarm_run, .period = 1000000 / TIMER_HZ };
+#else
+static void *alarm_thread(void *arg) {
+  int fd = (intptr_t)arg;
+  uint64_t nr_expire;
+  // ticks missed while the CPU is busy are merged into one
+  while (read(fd, &nr_expire, sizeof(nr_expire)) == sizeof(nr_expire)) {
+    atomic_store_explicit(&alarm_pending, true, memory_order_relaxed);
+  }
+  return NULL;
+}
+#endif
+
 void init_alarm() {
-  struct sigaction s;
-  memset(&s, 0, sizeof(s));
-  s.sa_handler = alarm_sig_handler;
-  int ret = sigaction(SIGVTALRM, &s, NULL);
-  Assert(ret == 0, "Can not set signal handler");
+#ifdef CONFIG_ICOUNT
+  event_schedule(&alarm_event, alarm_event.period);
+#else
+  int fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+  Assert(fd >= 0, "Can not create timer");
 
-  struct itimerval it = {};
+  struct itimerspec it = {};
   it.it_value.tv_sec = 0;
-  it.it_value.tv_usec = 1000000 / TIMER_HZ;
+  it.it_value.tv_nsec = 1000000000 / TIMER_HZ;
   it.it_interval = it.it_value;
-  ret = setitimer(ITIMER_VIRTUAL, &it, NULL);
+  int ret = timerfd_settime(fd, 0, &it, NULL);
   Assert(ret == 0, "Can not set timer");
+
+  pthread_t thread;
+  ret = pthread_create(&thread, NULL, alarm_thread, (void *)(intptr_t)fd);
+  Assert(ret == 0, "Can not create the alarm thread");
+  pthread_detach(thread);
+#endif
 }
@@ -16,6 +16,7 @@
 #include <common.h>
 #include <utils.h>
 #include <device/alarm.h>
+#include <device/event.h>
 #ifndef CONFIG_TARGET_AM
 #include <SDL2/SDL.h>
 #endif
@@ -31,19 +32,63 @@ void init_sdcard();
 void init_alarm();
 
 void send_key(uint8_t, bool);
-void vga_update_screen();
 
-void device_update() {
-  static uint64_t last = 0;
-  uint64_t now = get_time();
-  if (now - last < 1000000 / TIMER_HZ) {
-    return;
-  }
-  last = now;
+/* The devices do their timed work in events, see src/device/event.c.
+ * Sampling the host time is expensive compared with an instruction, so
+ * the CPU runs for a countdown of guest instructions, which is expected to
+ * reach the deadline of the next event, before the time is sampled. The
+ * countdown is derived from the simulation speed measured between two
+ * samples, and kept within [POLL_MIN_INST, POLL_MAX_INST].
+ *
+ * With ICOUNT, the guest time is derived from the number of instructions,
+ * so the countdown simply expires at the deadline.
+ */
+#define POLL_MIN_INST 256
+#define POLL_MAX_INST (1ull << 24)
+
+extern uint64_t g_nr_guest_inst;
+static uint64_t next_poll_inst = 0;
+
+static void update_poll_countdown(uint64_t now, uint64_t deadline) {
+#ifdef CONFIG_ICOUNT
+  next_poll_inst = (deadline > UINT64_MAX / CONFIG_ICOUNT_RATE ?
+      UINT64_MAX : deadline * CONFIG_ICOUNT_RATE);
+#else
+  // the number of instructions executed in 1 ms
+  static uint64_t last_time = 0, last_inst = 0;
+  static uint64_t inst_per_ms = POLL_MIN_INST;
+  uint64_t dt = now - last_time;
+  uint64_t di = g_nr_guest_inst - last_inst;
+  inst_per_ms = (dt == 0 ? inst_per_ms * 2 : di * 1000 / dt);
+  if (inst_per_ms > POLL_MAX_INST) inst_per_ms = POLL_MAX_INST;
+  last_time = now;
+  last_inst = g_nr_guest_inst;
+
+  uint64_t wait = deadline - now;
+  uint64_t poll_inst = (wait >= 1000000 ? POLL_MAX_INST : wait * inst_per_ms / 1000);
+  if (poll_inst < POLL_MIN_INST) poll_inst = POLL_MIN_INST;
+  if (poll_inst > POLL_MAX_INST) poll_inst = POLL_MAX_INST;
+  next_poll_inst = g_nr_guest_inst + poll_inst;
+#endif
+}
+
+// called when an event is scheduled before the current deadline
+void device_sync_deadline() {
+  next_poll_inst = 0;
+}
 
-  IFDEF(CONFIG_HAS_VGA, vga_update_screen());
+void device_update() {
+#ifndef CONFIG_TARGET_AM
+  if (unlikely(atomic_load_explicit(&alarm_pending, memory_order_relaxed))) alarm_run();
+#endif
+  if (likely(g_nr_guest_inst < next_poll_inst)) return;
+  uint64_t now = get_guest_time();
+  uint64_t deadline = event_run(now);
+  update_poll_countdown(now, deadline);
+}
 
 #ifndef CONFIG_TARGET_AM
+static void sdl_poll_event() {
   SDL_Event event;
   while (SDL_PollEvent(&event)) {
     switch (event.type) {
@@ -63,9 +108,11 @@ void device_update() {
       default: break;
     }
   }
-#endif
 }
 
+static Event sdl_event = { .handler = sdl_poll_event, .period = 1000000 / TIMER_HZ };
+#endif
+
 void sdl_clear_event_queue() {
 #ifndef CONFIG_TARGET_AM
   SDL_Event event;
@@ -86,4 +133,5 @@ void init_device() {
   IFDEF(CONFIG_HAS_SDCARD, init_sdcard());
 
   IFNDEF(CONFIG_TARGET_AM, init_alarm());
+  IFNDEF(CONFIG_TARGET_AM, event_schedule(&sdl_event, sdl_event.period));
 }
@@ -0,0 +1,96 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <device/event.h>
+#include <utils.h>
+
+/* The events are kept in a binary min-heap on `when`, stored from
+ * queue[1], and each event remembers its position so that it can be
+ * cancelled or rescheduled in place. device_update() only samples the
+ * time at the deadline of the first event, so it must be told when an
+ * earlier event is scheduled.
+ */
+
+#define MAX_EVENT 32
+
+static Event *queue[MAX_EVENT + 1] = {};
+static int nr_event = 0;
+
+void device_sync_deadline();
+
+static void swap(int i, int j) {
+  Event *t = queue[i];
+  queue[i] = queue[j];
+  queue[j] = t;
+  queue[i]->idx = i;
+  queue[j]->idx = j;
+}
+
+static void sift_up(int i) {
+  for (; i > 1 && queue[i / 2]->when > queue[i]->when; i /= 2) {
+    swap(i, i / 2);
+  }
+}
+
+static void sift_down(int i) {
+  while (true) {
+    int min = i, l = i * 2, r = l + 1;
+    if (l <= nr_event && queue[l]->when < queue[min]->when) min = l;
+    if (r <= nr_event && queue[r]->when < queue[min]->when) min = r;
+    if (min == i) return;
+    swap(i, min);
+    i = min;
+  }
+}
+
+void event_cancel(Event *e) {
+  int i = e->idx;
+  if (i == 0) return;
+  e->idx = 0;
+  Event *last = queue[nr_event --];
+  if (last == e) return;
+  queue[i] = last;
+  last->idx = i;
+  sift_up(i);
+  sift_down(last->idx);
+}
+
+static void event_insert(Event *e, uint64_t when) {
+  event_cancel(e);
+  assert(nr_event < MAX_EVENT);
+  e->when = when;
+  e->idx = ++ nr_event;
+  queue[nr_event] = e;
+  sift_up(nr_event);
+}
+
+void event_schedule(Event *e, uint64_t delay) {
+  event_insert(e, get_guest_time() + delay);
+  if (e->idx == 1) device_sync_deadline();
+}
+
+uint64_t event_run(uint64_t now) {
+  while (nr_event > 0 && queue[1]->when <= now) {
+    Event *e = queue[1];
+    if (e->period != 0) {
+      e->when = now + e->period;
+      sift_down(1);
+    } else {
+      event_cancel(e);
+    }
+    e->handler();
+  }
+  return (nr_event > 0 ? queue[1]->when : UINT64_MAX);
+}
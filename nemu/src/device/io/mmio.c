@@ -13,17 +13,79 @@
 * See the Mulan PSL v2 for more details.
 ***************************************************************************************/
 
+#include <isa.h>
 #include <device/map.h>
+#include <memory/host.h>
 #include <memory/paddr.h>
+#include <memory/vaddr.h>
 
 #define NR_MAP 16
 
 static IOMap maps[NR_MAP] = {};
 static int nr_map = 0;
 
-static IOMap* fetch_mmio_map(paddr_t addr) {
-  int mapid = find_mapid_by_addr(maps, nr_map, addr);
-  return (mapid == -1 ? NULL : &maps[mapid]);
+/* MMIO is dispatched by a page table over the 32-bit physical address space,
+ * with the second levels allocated on demand since the regions are sparse.
+ *
+ * A page fully covered by a map without callback (e.g. vmem) records the
+ * host address of the page, and is accessed as directly as pmem. Other pages
+ * may hold several small maps, so the map owning each byte is recorded
+ * instead. Either way, finding the target of an access takes constant time.
+ */
+#define MMIO_L2_SHIFT 22
+#define MMIO_L2_SIZE (1u << (MMIO_L2_SHIFT - PAGE_SHIFT))
+
+typedef struct {
+  uint8_t *host;   // host address of the page if it is accessed directly
+  uint8_t *owner;  // otherwise, index + 1 of the map owning each byte, or 0
+  uint8_t dirty;   // see paddr_dirty_test()
+} MMIOPage;
+
+static MMIOPage *mmio_table[1u << (32 - MMIO_L2_SHIFT)] = {};
+
+static inline MMIOPage* fetch_mmio_page(paddr_t addr) {
+  if ((uint64_t)addr >> 32 != 0) return NULL;
+  MMIOPage *l2 = mmio_table[(uint32_t)addr >> MMIO_L2_SHIFT];
+  return (l2 == NULL ? NULL : &l2[((uint32_t)addr >> PAGE_SHIFT) & (MMIO_L2_SIZE - 1)]);
+}
+
+static MMIOPage* alloc_mmio_page(paddr_t addr) {
+  Assert((uint64_t)addr >> 32 == 0, "MMIO address " FMT_PADDR " is beyond 4GB", addr);
+  MMIOPage **l2 = &mmio_table[(uint32_t)addr >> MMIO_L2_SHIFT];
+  if (*l2 == NULL) {
+    *l2 = calloc(MMIO_L2_SIZE, sizeof(MMIOPage));
+    assert(*l2);
+  }
+  return fetch_mmio_page(addr);
+}
+
+static void mmio_out_of_bound(paddr_t addr) {
+  panic("address (" FMT_PADDR ") is out of bound at pc = " FMT_WORD, addr, cpu.pc);
+}
+
+static void map_mmio_pages(IOMap *map, int mapid) {
+  for (paddr_t page = map->low & ~PAGE_MASK; page <= map->high; page += PAGE_SIZE) {
+    MMIOPage *p = alloc_mmio_page(page);
+    p->dirty = DIRTY_ALL;
+    paddr_t left = (page > map->low ? page : map->low);
+    paddr_t right = (page + PAGE_MASK < map->high ? page + PAGE_MASK : map->high);
+    if (map->callback == NULL && left == page && right == page + PAGE_MASK) {
+      p->host = (uint8_t *)map->space + (page - map->low);
+    } else {
+      if (p->owner == NULL) {
+        p->owner = calloc(PAGE_SIZE, 1);
+        assert(p->owner);
+      }
+      memset(p->owner + (left & PAGE_MASK), mapid + 1, right - left + 1);
+    }
+    if (page + PAGE_SIZE < page) break; // wrap around
+  }
+}
+
+static inline IOMap* fetch_mmio_map(MMIOPage *p, paddr_t addr) {
+  int idx = (p->owner == NULL ? 0 : p->owner[addr & PAGE_MASK]);
+  if (unlikely(idx == 0)) mmio_out_of_bound(addr);
+  return &maps[idx - 1];
 }
 
 static void report_mmio_overlap(const char *name1, paddr_t l1, paddr_t r1,
@@ -47,6 +109,7 @@ void add_mmio_map(const char *name, paddr_t addr, void *space, uint32_t len, io_
 
   maps[nr_map] = (IOMap){ .name = name, .low = addr, .high = addr + len - 1,
     .space = space, .callback = callback };
+  map_mmio_pages(&maps[nr_map], nr_map);
   Log("Add mmio map '%s' at [" FMT_PADDR ", " FMT_PADDR "]",
       maps[nr_map].name, maps[nr_map].low, maps[nr_map].high);
 
@@ -55,9 +118,35 @@ void add_mmio_map(const char *name, paddr_t addr, void *space, uint32_t len, io_
 
 /* bus interface */
 word_t mmio_read(paddr_t addr, int len) {
-  return map_read(addr, len, fetch_mmio_map(addr));
+  MMIOPage *p = fetch_mmio_page(addr);
+  if (unlikely(p == NULL)) mmio_out_of_bound(addr);
+  // the devices are not simulated by the reference
+  difftest_skip_ref();
+  if (likely(p->host != NULL)) return host_read(p->host + (addr & PAGE_MASK), len);
+  return map_read(addr, len, fetch_mmio_map(p, addr));
 }
 
 void mmio_write(paddr_t addr, int len, word_t data) {
-  map_write(addr, len, data, fetch_mmio_map(addr));
+  MMIOPage *p = fetch_mmio_page(addr);
+  if (unlikely(p == NULL)) mmio_out_of_bound(addr);
+  difftest_skip_ref();
+  p->dirty = DIRTY_ALL;
+  if (likely(p->host != NULL)) { host_write(p->host + (addr & PAGE_MASK), len, data); return; }
+  map_write(addr, len, data, fetch_mmio_map(p, addr));
+}
+
+uint8_t* mmio_dirty_flags(paddr_t addr) {
+  MMIOPage *p = fetch_mmio_page(addr);
+  return (p == NULL || (p->host == NULL && p->owner == NULL) ? NULL : &p->dirty);
+}
+
+bool mmio_find_map(const char *name, paddr_t *low, paddr_t *high) {
+  for (int i = 0; i < nr_map; i ++) {
+    if (strcmp(maps[i].name, name) == 0) {
+      *low = maps[i].low;
+      *high = maps[i].high;
+      return true;
+    }
+  }
+  return false;
 }
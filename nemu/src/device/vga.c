@@ -15,6 +15,10 @@
 
 #include <common.h>
 #include <device/map.h>
+#include <memory/paddr.h>
+#include <memory/vaddr.h>
+#include <device/alarm.h>
+#include <device/event.h>
 
 #define SCREEN_W (MUXDEF(CONFIG_VGA_SIZE_800x600, 800, 400))
 #define SCREEN_H (MUXDEF(CONFIG_VGA_SIZE_800x600, 600, 300))
@@ -56,8 +60,12 @@ static void init_screen() {
   SDL_RenderPresent(renderer);
 }
 
-static inline void update_screen() {
-  SDL_UpdateTexture(texture, NULL, vmem, SCREEN_W * sizeof(uint32_t));
+static void update_rows(int y, int h) {
+  SDL_Rect rect = { .x = 0, .y = y, .w = SCREEN_W, .h = h };
+  SDL_UpdateTexture(texture, &rect, (uint32_t *)vmem + y * SCREEN_W, SCREEN_W * sizeof(uint32_t));
+}
+
+static void present_screen() {
   SDL_RenderClear(renderer);
   SDL_RenderCopy(renderer, texture, NULL, NULL);
   SDL_RenderPresent(renderer);
@@ -65,13 +73,40 @@ static inline void update_screen() {
 #else
 static void init_screen() {}
 
-static inline void update_screen() {
-  io_write(AM_GPU_FBDRAW, 0, 0, vmem, screen_width(), screen_height(), true);
+static void update_rows(int y, int h) {
+  io_write(AM_GPU_FBDRAW, 0, y, (uint32_t *)vmem + y * screen_width(), screen_width(), h, false);
+}
+
+static void present_screen() {
+  io_write(AM_GPU_FBDRAW, 0, 0, NULL, 0, 0, true);
 }
 #endif
+
+/* Only the rows covered by the pages of vmem written since the last
+ * update are uploaded, as most frames change a small part of the screen.
+ * Adjacent dirty pages are merged into one band of rows.
+ */
+static void update_screen() {
+  uint32_t pitch = screen_width() * sizeof(uint32_t);
+  uint32_t size = screen_size();
+  int y0 = 0, y1 = -1; // the current band of dirty rows [y0, y1]
+  for (uint32_t off = 0; off < size; off += PAGE_SIZE) {
+    uint32_t len = (size - off < PAGE_SIZE ? size - off : PAGE_SIZE);
+    if (!paddr_dirty_test(CONFIG_FB_ADDR + off, len, DIRTY_VGA)) continue;
+    int top = off / pitch, bottom = (off + len - 1) / pitch;
+    if (top > y1 + 1) {
+      if (y1 >= y0) update_rows(y0, y1 - y0 + 1);
+      y0 = top;
+    }
+    y1 = bottom;
+  }
+  if (y1 >= y0) update_rows(y0, y1 - y0 + 1);
+  paddr_dirty_clear(CONFIG_FB_ADDR, size, DIRTY_VGA);
+  present_screen();
+}
 #endif
 
-void vga_update_screen() {
+static void vga_update_screen() {
   // TODO: call `update_screen()` when the sync register is non-zero,
   // then zero out the sync register
   if (vgactl_port_base[1] != 0) {
@@ -80,6 +115,8 @@ void vga_update_screen() {
   }
 }
 
+static Event vsync_event = { .handler = vga_update_screen, .period = 1000000 / TIMER_HZ };
+
 void init_vga() {
   vgactl_port_base = (uint32_t *)new_space(8);
   vgactl_port_base[0] = (screen_width() << 16) | screen_height();
@@ -93,4 +130,5 @@ void init_vga() {
   add_mmio_map("vmem", CONFIG_FB_ADDR, vmem, screen_size(), NULL);
   IFDEF(CONFIG_VGA_SHOW_SCREEN, init_screen());
   IFDEF(CONFIG_VGA_SHOW_SCREEN, memset(vmem, 0, screen_size()));
+  event_schedule(&vsync_event, vsync_event.period);
 }
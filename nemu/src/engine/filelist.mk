@@ -15,3 +15,6 @@
 
 INC_PATH += $(NEMU_HOME)/src/engine/$(ENGINE)
 DIRS-y += src/engine/$(ENGINE)
+
+# the threaded engine shares the rest with the interpreter
+DIRS-$(CONFIG_ENGINE_THREADED) += src/engine/interpreter
@@ -0,0 +1,207 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <cpu/cpu.h>
+#include <cpu/decode.h>
+#include <memory/paddr.h>
+#include <memory/vaddr.h>
+
+/* Basic blocks are translated into arrays of pre-decoded instructions which
+ * are executed back to back by isa_exec_block(). Each block remembers the
+ * blocks it has jumped to, so that the hash table is only looked up when
+ * a successor is seen for the first time.
+ *
+ * With TCACHE_JIT, hot blocks are further translated into host code, which
+ * runs the whole block and sets `cpu.pc` by itself.
+ */
+
+#define TB_MAX_INST 64
+#define NR_TB 16384
+#define NR_TB_INST (NR_TB * 16)
+#define TB_HASH_SIZE 8192
+#define TB_HASH(pc) (((pc) >> 2) & (TB_HASH_SIZE - 1))
+#define NR_SUCC 2
+
+typedef struct TBlock {
+  vaddr_t pc;
+  int n;
+  bool valid;
+  bool stop; // tcache_exec() may need to return before this block
+  struct TBlock *hnext; // next block in the same hash bucket
+  struct TBlock *pnext; // next block in the same page
+  struct {
+    vaddr_t pc;
+    struct TBlock *tb;
+  } succ[NR_SUCC];
+  Decode *s;
+#ifdef CONFIG_TCACHE_JIT
+  uint32_t nr_run;
+  int (*code)();
+#endif
+} TBlock;
+
+static TBlock tb_pool[NR_TB] = {};
+static Decode inst_pool[NR_TB_INST] = {};
+static int nr_tb = 0, nr_inst = 0;
+static TBlock *tb_hash[TB_HASH_SIZE] = {};
+static TBlock *tb_page[CONFIG_MSIZE >> PAGE_SHIFT] = {};
+// bumped on every flush, so that stale pointers to blocks are not linked
+static uint64_t tb_gen = 0;
+// blocks end before this pc, so that tcache_exec() can return there
+static vaddr_t tb_stop_pc = (vaddr_t)-1;
+
+extern uint64_t g_nr_guest_inst;
+void device_update();
+
+void tcache_flush() {
+  nr_tb = nr_inst = 0;
+  memset(tb_hash, 0, sizeof(tb_hash));
+  memset(tb_page, 0, sizeof(tb_page));
+  tb_gen ++;
+  IFDEF(CONFIG_TCACHE_JIT, isa_jit_reset());
+  isa_exec_block_stop();
+}
+
+void tcache_set_stop(vaddr_t pc) {
+  if (pc == tb_stop_pc) return;
+  tb_stop_pc = pc;
+  tcache_flush();
+}
+
+// called by the memory when a page holding translated blocks is written
+void tcache_invalidate(paddr_t page) {
+  if (!in_pmem(page)) return;
+  TBlock **pp = &tb_page[(page - CONFIG_MBASE) >> PAGE_SHIFT];
+  for (TBlock *tb = *pp; tb != NULL; tb = tb->pnext) {
+    tb->valid = false;
+    TBlock **hp = &tb_hash[TB_HASH(tb->pc)];
+    while (*hp != tb) hp = &(*hp)->hnext;
+    *hp = tb->hnext;
+  }
+  *pp = NULL;
+  // the running block may be one of them, stop it after the current instruction
+  isa_exec_block_stop();
+}
+
+static TBlock *tb_lookup(vaddr_t pc) {
+  for (TBlock *tb = tb_hash[TB_HASH(pc)]; tb != NULL; tb = tb->hnext) {
+    if (tb->pc == pc) return tb;
+  }
+  return NULL;
+}
+
+static bool tb_stop_at(vaddr_t pc) {
+  return pc == tb_stop_pc || bp_exist(pc);
+}
+
+static TBlock *tb_translate(vaddr_t pc) {
+  if (nr_tb == NR_TB || nr_inst + TB_MAX_INST > NR_TB_INST) tcache_flush();
+
+  TBlock *tb = &tb_pool[nr_tb ++];
+  tb->pc = pc;
+  tb->valid = true;
+  tb->stop = tb_stop_at(pc);
+  tb->s = &inst_pool[nr_inst];
+  IFDEF(CONFIG_TCACHE_JIT, tb->nr_run = 0);
+  IFDEF(CONFIG_TCACHE_JIT, tb->code = NULL);
+  for (int i = 0; i < NR_SUCC; i ++) {
+    tb->succ[i].pc = (vaddr_t)-1;
+    tb->succ[i].tb = NULL;
+  }
+
+  // a block never crosses a page, since it is invalidated page by page
+  vaddr_t page = pc & ~PAGE_MASK;
+  int n = 0;
+  bool end = false;
+  while (!end && n < TB_MAX_INST && (pc & ~PAGE_MASK) == page && !(n > 0 && tb_stop_at(pc))) {
+    Decode *s = &tb->s[n ++];
+    s->pc = pc;
+    s->snpc = pc;
+    end = isa_decode_once(s);
+    pc = s->snpc;
+  }
+  tb->n = n;
+  nr_inst += n;
+  IFDEF(CONFIG_TCACHE_FUSION, isa_fuse_block(tb->s, n));
+
+  TBlock **hp = &tb_hash[TB_HASH(tb->pc)];
+  tb->hnext = *hp;
+  *hp = tb;
+  // blocks are invalidated by the physical page written
+  paddr_t ppc = vaddr_to_paddr(tb->pc, MEM_TYPE_IFETCH);
+  if (in_pmem(ppc)) {
+    TBlock **pp = &tb_page[(ppc - CONFIG_MBASE) >> PAGE_SHIFT];
+    tb->pnext = *pp;
+    *pp = tb;
+    paddr_dirty_clear(ppc, 1, DIRTY_CODE);
+  } else {
+    tb->pnext = NULL;
+  }
+  return tb;
+}
+
+static void tb_link(TBlock *tb, TBlock *next) {
+  int i;
+  for (i = 0; i < NR_SUCC - 1; i ++) {
+    if (tb->succ[i].tb == NULL || tb->succ[i].pc == next->pc) break;
+  }
+  tb->succ[i].pc = next->pc;
+  tb->succ[i].tb = next;
+}
+
+static inline TBlock *tb_chain(TBlock *tb, vaddr_t pc) {
+  for (int i = 0; i < NR_SUCC; i ++) {
+    TBlock *next = tb->succ[i].tb;
+    if (tb->succ[i].pc == pc && likely(next->valid)) return next;
+  }
+  return NULL;
+}
+
+void tcache_exec(uint64_t n) {
+  TBlock *tb = NULL;
+  while (n > 0) {
+    vaddr_t pc = cpu.pc;
+    TBlock *next = (tb != NULL ? tb_chain(tb, pc) : NULL);
+    uint64_t gen = tb_gen;
+    if (next == NULL) {
+      next = tb_lookup(pc);
+      if (next == NULL) next = tb_translate(pc);
+      if (tb != NULL && gen == tb_gen) tb_link(tb, next);
+    }
+    tb = next;
+    if (unlikely(tb->stop) && (pc == tb_stop_pc || cpu_break_at(pc))) break;
+
+    int nr_exec;
+#ifdef CONFIG_TCACHE_JIT
+    if (unlikely(tb->code == NULL) && ++ tb->nr_run == CONFIG_TCACHE_JIT_THRESHOLD) {
+      tb->code = isa_jit_translate(tb->s, tb->n);
+      // the code cache is full, start over after running this block
+      if (tb->code == NULL) tcache_flush();
+    }
+    if (tb->code != NULL && n >= tb->n) nr_exec = tb->code();
+    else
+#endif
+    {
+      nr_exec = isa_exec_block(tb->s, (n < tb->n ? n : tb->n));
+      cpu.pc = tb->s[nr_exec - 1].dnpc;
+    }
+    g_nr_guest_inst += nr_exec;
+    n -= nr_exec;
+    // the blocks may be gone, so do not link to this one
+    if (tb_gen != gen) tb = NULL;
+    if (nemu_state.state != NEMU_RUNNING) break;
+    IFDEF(CONFIG_DEVICE, device_update());
+  }
+}
@@ -15,3 +15,24 @@
 
 INC_PATH += $(NEMU_HOME)/src/isa/$(GUEST_ISA)/include
 DIRS-y += src/isa/$(GUEST_ISA)
+
+ifndef CONFIG_TCACHE_JIT
+SRCS-BLACKLIST-y += src/isa/$(GUEST_ISA)/jit.c
+endif
+
+ifdef CONFIG_DECODE_TREE
+GEN_DECODE_PATH := $(NEMU_HOME)/tools/gen-decode
+GEN_DECODE := $(GEN_DECODE_PATH)/build/gen-decode
+INSTPAT_TREE := $(NEMU_HOME)/include/generated/instpat-tree.h
+INSTPAT_SRC := src/isa/$(GUEST_ISA)/inst.c
+
+# the tree is regenerated whenever the patterns change, so let the object
+# instead of the source depend on it
+$(shell pwd)/build/obj-$(NAME)/$(INSTPAT_SRC:.c=.o): $(INSTPAT_TREE)
+$(INSTPAT_TREE): $(INSTPAT_SRC) $(NEMU_HOME)/include/cpu/decode.h $(NEMU_HOME)/include/generated/autoconf.h $(GEN_DECODE)
+	@echo + GEN $@
+	@$(CC) $(filter-out -MMD,$(CFLAGS)) -D__INSTPAT_GEN__ -E -P $(INSTPAT_SRC) | $(GEN_DECODE) > $@.tmp
+	@mv $@.tmp $@
+$(GEN_DECODE): $(GEN_DECODE_PATH)/gen-decode.c
+	@$(MAKE) -s -C $(GEN_DECODE_PATH)
+endif
@@ -17,6 +17,9 @@
 #include <cpu/cpu.h>
 #include <cpu/ifetch.h>
 #include <cpu/decode.h>
+#ifdef CONFIG_DECODE_TREE
+#include <generated/instpat-tree.h>
+#endif
 
 #define R(i) gpr(i)
 #define Mr vaddr_read
@@ -72,3 +75,14 @@ int isa_exec_once(Decode *s) {
   s->isa.inst = inst_fetch(&s->snpc, 4);
   return decode_exec(s);
 }
+
+// bl, or jirl with rd = $ra
+bool isa_inst_is_call(Decode *s) {
+  uint32_t i = s->isa.inst;
+  return (i >> 26) == 0x15 || ((i >> 26) == 0x13 && (i & 0x1f) == 1);
+}
+
+// jirl $zero, $ra, 0
+bool isa_inst_is_ret(Decode *s) {
+  return s->isa.inst == 0x4c000020;
+}
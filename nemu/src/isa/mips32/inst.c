@@ -17,6 +17,9 @@
 #include <cpu/cpu.h>
 #include <cpu/ifetch.h>
 #include <cpu/decode.h>
+#ifdef CONFIG_DECODE_TREE
+#include <generated/instpat-tree.h>
+#endif
 
 #define R(i) gpr(i)
 #define Mr vaddr_read
@@ -74,3 +77,14 @@ int isa_exec_once(Decode *s) {
   s->isa.inst = inst_fetch(&s->snpc, 4);
   return decode_exec(s);
 }
+
+// jal, or jalr with rd = $ra
+bool isa_inst_is_call(Decode *s) {
+  uint32_t i = s->isa.inst;
+  return (i >> 26) == 0x03 || (i & 0xfc1ff83f) == 0x0000f809;
+}
+
+// jr $ra
+bool isa_inst_is_ret(Decode *s) {
+  return s->isa.inst == 0x03e00008;
+}
@@ -18,6 +18,16 @@
 #include "../local-include/reg.h"
 
 bool isa_difftest_checkregs(CPU_state *ref_r, vaddr_t pc) {
+  /* NEMU has no privilege levels, while the reference runs the guest in
+   * M-mode, where satp does not translate. So the reference can not follow
+   * the guest once Sv32 is enabled. */
+  if (MUXDEF(CONFIG_RV64, 0, cpu.satp >> 31)) {
+    Log("Sv32 is enabled at pc = " FMT_WORD ", which the reference can not follow, "
+        "so differential testing is detached", pc);
+    difftest_detach();
+    return true;
+  }
+
   if (ref_r->pc != cpu.pc) {
     return false;
   }
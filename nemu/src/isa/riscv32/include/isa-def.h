@@ -21,13 +21,19 @@
 typedef struct {
   word_t gpr[MUXDEF(CONFIG_RVE, 16, 32)];
   vaddr_t pc;
+  word_t satp;
 } MUXDEF(CONFIG_RV64, riscv64_CPU_state, riscv32_CPU_state);
 
 // decode
 typedef struct {
   uint32_t inst;
+  uint8_t rd, rs1, rs2;
+  word_t imm;
+  const void *EHelper; // the body of the matched instruction
 } MUXDEF(CONFIG_RV64, riscv64_ISADecodeInfo, riscv32_ISADecodeInfo);
 
-#define isa_mmu_check(vaddr, len, type) (MMU_DIRECT)
+// Sv32 is enabled by satp.MODE
+#define isa_mmu_check(vaddr, len, type) \
+  (MUXDEF(CONFIG_RV64, 0, cpu.satp >> 31) ? MMU_TRANSLATE : MMU_DIRECT)
 
 #endif
@@ -32,6 +32,8 @@ static void restart() {
 
   /* The zero register is always 0. */
   cpu.gpr[0] = 0;
+
+  IFDEF(CONFIG_DECODE_CACHE, isa_dcache_flush());
 }
 
 void init_isa() {
@@ -15,7 +15,11 @@
 
 #include <cpu/cpu.h>
 #include <cpu/decode.h>
+#ifdef CONFIG_DECODE_TREE
+#include <generated/instpat-tree.h>
+#endif
 #include <cpu/ifetch.h>
+#include <memory/paddr.h>
 
 #include "local-include/reg.h"
 
@@ -33,14 +37,6 @@ enum {
   TYPE_N,  // none
 };
 
-#define src1R()     \
-  do {              \
-    *src1 = R(rs1); \
-  } while (0)
-#define src2R()     \
-  do {              \
-    *src2 = R(rs2); \
-  } while (0)
 #define immI()                        \
   do {                                \
     *imm = SEXT(BITS(i, 31, 20), 12); \
@@ -64,35 +60,41 @@ enum {
            (BITS(i, 7, 7) << 11) | (BITS(i, 30, 25) << 5);            \
   } while (0)
 
-static void decode_operand(Decode *s, int *rd, word_t *src1, word_t *src2,
-                           word_t *imm, int type) {
+// Register indices and the immediate are resolved once at decode time and
+// kept in `s->isa`, so that a cached instruction can be executed without
+// decoding it again. Unused source registers are pointed to $zero.
+static void decode_operand(Decode *s, int type) {
   uint32_t i = s->isa.inst;
+  word_t *imm = &s->isa.imm;
   int rs1 = BITS(i, 19, 15);
   int rs2 = BITS(i, 24, 20);
-  *rd = BITS(i, 11, 7);
+  s->isa.rd = BITS(i, 11, 7);
+  s->isa.rs1 = 0;
+  s->isa.rs2 = 0;
+  *imm = 0;
   switch (type) {
     case TYPE_I:
-      src1R();
+      s->isa.rs1 = rs1;
       immI();
       break;
     case TYPE_U:
       immU();
       break;
     case TYPE_S:
-      src1R();
-      src2R();
+      s->isa.rs1 = rs1;
+      s->isa.rs2 = rs2;
       immS();
       break;
     case TYPE_J:
       immJ();
       break;
     case TYPE_R:
-      src1R();
-      src2R();
+      s->isa.rs1 = rs1;
+      s->isa.rs2 = rs2;
       break;
     case TYPE_B:
-      src1R();
-      src2R();
+      s->isa.rs1 = rs1;
+      s->isa.rs2 = rs2;
       immB();
       break;
     case TYPE_N:
@@ -102,18 +104,162 @@ static void decode_operand(Decode *s, int *rd, word_t *src1, word_t *src2,
   }
 }
 
+static inline void load_operand(Decode *s, int *rd, word_t *src1, word_t *src2,
+                                word_t *imm) {
+  *rd = s->isa.rd;
+  *src1 = R(s->isa.rs1);
+  *src2 = R(s->isa.rs2);
+  *imm = s->isa.imm;
+}
+
+#ifdef CONFIG_DECODE_CACHE
+#define DCACHE_IDX(pc) (((pc) >> 2) & (CONFIG_DECODE_CACHE_SIZE - 1))
+#define DCACHE_INVALID ((vaddr_t)-1)
+
+static_assert((CONFIG_DECODE_CACHE_SIZE & (CONFIG_DECODE_CACHE_SIZE - 1)) == 0,
+              "CONFIG_DECODE_CACHE_SIZE must be a power of 2");
+
+typedef struct {
+  vaddr_t pc;
+  ISADecodeInfo isa;
+} DCacheEntry;
+
+static DCacheEntry dcache[CONFIG_DECODE_CACHE_SIZE] = {};
+
+/* The entries are indexed by virtual addresses, while the code is written
+ * through physical pages. So each page of pmem remembers the virtual page
+ * its cached instructions are fetched from. Only a page fetched from
+ * several virtual pages flushes the whole cache when it is written. The
+ * cache is flushed whenever the mapping changes, see mmu_flush().
+ */
+#define VPAGE_NONE ((vaddr_t)-1)
+#define VPAGE_MANY ((vaddr_t)-2)
+
+static vaddr_t dcache_vpage[CONFIG_MSIZE >> PAGE_SHIFT];
+
+void isa_dcache_flush() {
+  for (int i = 0; i < CONFIG_DECODE_CACHE_SIZE; i++) {
+    dcache[i].pc = DCACHE_INVALID;
+  }
+  for (int i = 0; i < ARRLEN(dcache_vpage); i++) {
+    dcache_vpage[i] = VPAGE_NONE;
+  }
+}
+
+// called by the memory when a page holding cached instructions is written
+void isa_dcache_invalidate(paddr_t page) {
+  vaddr_t *v = &dcache_vpage[(page - CONFIG_MBASE) >> PAGE_SHIFT];
+  vaddr_t vpage = *v;
+  if (vpage == VPAGE_MANY) {
+    isa_dcache_flush();
+    return;
+  }
+  *v = VPAGE_NONE;
+  if (vpage == VPAGE_NONE) return;
+  for (vaddr_t pc = vpage; pc - vpage < PAGE_SIZE; pc += 4) {
+    DCacheEntry *e = &dcache[DCACHE_IDX(pc)];
+    if (e->pc == pc) e->pc = DCACHE_INVALID;
+  }
+}
+
+// record it before executing, since the instruction may overwrite itself
+static inline void dcache_insert(Decode *s) {
+  DCacheEntry *e = &dcache[DCACHE_IDX(s->pc)];
+  paddr_t pa = vaddr_to_paddr(s->pc, MEM_TYPE_IFETCH);
+  paddr_dirty_clear(pa, 1, DIRTY_CODE);
+  if (in_pmem(pa)) {
+    vaddr_t *v = &dcache_vpage[(pa - CONFIG_MBASE) >> PAGE_SHIFT];
+    vaddr_t vpage = s->pc & ~PAGE_MASK;
+    if (*v == VPAGE_NONE) *v = vpage;
+    else if (*v != vpage) *v = VPAGE_MANY;
+  }
+  e->pc = s->pc;
+  e->isa = s->isa;
+}
+#endif
+
+#ifdef CONFIG_ENGINE_THREADED
+// the instructions in [s, blk_end) are executed back to back
+static Decode *blk_end = NULL;
+static bool decode_only = false;
+#ifdef CONFIG_TCACHE_JIT
+extern bool jit_stopped;
+#endif
+
+// opcodes which may change the control flow or the state of NEMU
+static inline bool is_block_end(uint32_t inst) {
+  switch (BITS(inst, 6, 0)) {
+    case 0b1100011: case 0b1101111: case 0b1100111: case 0b1110011: return true;
+    default: return false;
+  }
+}
+#endif
+
+#ifdef CONFIG_TCACHE_FUSION
+/* Pairs of instructions in a block, where the second one consumes the result
+ * of the first one, are run by one body in decode_exec(). The first one of
+ * the pair points to the fused body, and the second one is skipped. The
+ * bodies are labels in decode_exec(), so it publishes their addresses in
+ * `fused_body` whenever it decodes, which happens before a block is fused. */
+enum {
+  FUSE_LUI_ADDI, FUSE_AUIPC_ADDI, FUSE_LUI_LW, FUSE_AUIPC_LW, FUSE_AUIPC_JALR,
+  FUSE_SLT_BEQ, FUSE_SLT_BNE, FUSE_SLTU_BEQ, FUSE_SLTU_BNE, NR_FUSE
+};
+static const void *const *fused_body = NULL;
+#endif
+
+/* If `s->isa.EHelper` is not NULL, the instruction has been decoded before,
+ * so jump to the recorded body directly. Otherwise the operands and the body
+ * of the matched pattern are recorded in `s->isa` before executing it.
+ *
+ * With the threaded engine, after finishing an instruction the body of the
+ * next pre-decoded instruction in the block is jumped to directly. Return the
+ * number of instructions executed.
+ */
 static int decode_exec(Decode *s) {
+#ifdef CONFIG_TCACHE_FUSION
+  static const void *const fused[NR_FUSE] = {
+    [FUSE_LUI_ADDI] = &&fuse_lui_addi, [FUSE_AUIPC_ADDI] = &&fuse_auipc_addi,
+    [FUSE_LUI_LW] = &&fuse_lui_lw, [FUSE_AUIPC_LW] = &&fuse_auipc_lw,
+    [FUSE_AUIPC_JALR] = &&fuse_auipc_jalr,
+    [FUSE_SLT_BEQ] = &&fuse_slt_beq, [FUSE_SLT_BNE] = &&fuse_slt_bne,
+    [FUSE_SLTU_BEQ] = &&fuse_sltu_beq, [FUSE_SLTU_BNE] = &&fuse_sltu_bne,
+  };
+#endif
+  IFDEF(CONFIG_ENGINE_THREADED, Decode *start = s);
   s->dnpc = s->snpc;
 
+#ifdef CONFIG_ENGINE_THREADED
+#define DECODE_ONLY_RETURN() \
+  if (unlikely(decode_only)) return is_block_end(s->isa.inst) || s->isa.EHelper == &&exec_inv;
+#define DISPATCH_NEXT() \
+  R(0) = 0; \
+  if (s + 1 < blk_end) { s ++; s->dnpc = s->snpc; goto *(s->isa.EHelper); }
+#else
+#define DECODE_ONLY_RETURN()
+#define DISPATCH_NEXT()
+#endif
+
 #define INSTPAT_INST(s) ((s)->isa.inst)
-#define INSTPAT_MATCH(s, name, type, ... /* execute body */)         \
-  {                                                                  \
-    int rd = 0;                                                      \
-    word_t src1 = 0, src2 = 0, imm = 0;                              \
-    decode_operand(s, &rd, &src1, &src2, &imm, concat(TYPE_, type)); \
-    __VA_ARGS__;                                                     \
+#define INSTPAT_MATCH(s, name, type, ... /* execute body */) \
+  {                                                          \
+    decode_operand(s, concat(TYPE_, type));                  \
+    s->isa.EHelper = &&concat(exec_, name);                  \
+    IFDEF(CONFIG_DECODE_CACHE, dcache_insert(s));            \
+    DECODE_ONLY_RETURN();                                    \
+  concat(exec_, name):                                       \
+    {                                                        \
+      int rd = 0;                                            \
+      word_t src1 = 0, src2 = 0, imm = 0;                    \
+      load_operand(s, &rd, &src1, &src2, &imm);              \
+      __VA_ARGS__;                                           \
+    }                                                        \
+    DISPATCH_NEXT();                                         \
   }
 
+  if (s->isa.EHelper != NULL) goto *(s->isa.EHelper);
+
+  IFDEF(CONFIG_TCACHE_FUSION, fused_body = fused);
   INSTPAT_START();
   INSTPAT("??????? ????? ????? ??? ????? 00101 11", auipc, U,
           R(rd) = s->pc + imm);
@@ -290,17 +436,154 @@ static int decode_exec(Decode *s) {
         R(rd) = src1;
       } else R(rd) = ((sword_t)src1) % ((sword_t)src2));
 
+  INSTPAT("??????? ????? ????? 001 ????? 11100 11", csrrw, I,
+          word_t t = csr_read(imm); csr_write(imm, src1); R(rd) = t);
+  INSTPAT("??????? ????? ????? 010 ????? 11100 11", csrrs, I,
+          word_t t = csr_read(imm); if (s->isa.rs1 != 0) csr_write(imm, t | src1); R(rd) = t);
+  INSTPAT("??????? ????? ????? 011 ????? 11100 11", csrrc, I,
+          word_t t = csr_read(imm); if (s->isa.rs1 != 0) csr_write(imm, t & ~src1); R(rd) = t);
+  INSTPAT("0001001 ????? ????? 000 00000 11100 11", sfence_vma, R,
+          mmu_flush());
   INSTPAT("0000000 00001 00000 000 00000 11100 11", ebreak, N,
           NEMUTRAP(s->pc, R(10)));  // R(10) is $a0
   INSTPAT("??????? ????? ????? ??? ????? ????? ??", inv, N, INV(s->pc));
   INSTPAT_END();
 
+#ifdef CONFIG_TCACHE_FUSION
+  goto fuse_end;
+
+// `s` is the first instruction of the pair and `t` is the second one. If the
+// block is cut before `t`, e.g. by single-stepping, only run the first one.
+#define FUSED(name, first, ... /* execute body */) \
+  concat(fuse_, name): {                           \
+    Decode *t = s + 1;                             \
+    if (unlikely(t >= blk_end)) goto concat(exec_, first); \
+    t->dnpc = t->snpc;                             \
+    __VA_ARGS__;                                   \
+    s = t;                                         \
+    DISPATCH_NEXT();                               \
+    goto fuse_end;                                 \
+  }
+
+  FUSED(lui_addi, lui,
+        R(s->isa.rd) = s->isa.imm;
+        R(t->isa.rd) = s->isa.imm + t->isa.imm);
+  FUSED(auipc_addi, auipc,
+        R(s->isa.rd) = s->pc + s->isa.imm;
+        R(t->isa.rd) = s->pc + s->isa.imm + t->isa.imm);
+  FUSED(lui_lw, lui,
+        R(s->isa.rd) = s->isa.imm;
+        R(t->isa.rd) = Mr(s->isa.imm + t->isa.imm, 4));
+  FUSED(auipc_lw, auipc,
+        R(s->isa.rd) = s->pc + s->isa.imm;
+        R(t->isa.rd) = Mr(s->pc + s->isa.imm + t->isa.imm, 4));
+  FUSED(auipc_jalr, auipc,
+        R(s->isa.rd) = s->pc + s->isa.imm;
+        t->dnpc = (s->pc + s->isa.imm + t->isa.imm) & 0xfffffffe;
+        R(t->isa.rd) = t->snpc);
+  FUSED(slt_beq, slt,
+        R(s->isa.rd) = ((sword_t)R(s->isa.rs1) < (sword_t)R(s->isa.rs2) ? 1 : 0);
+        if (R(s->isa.rd) == 0) t->dnpc = t->pc + t->isa.imm);
+  FUSED(slt_bne, slt,
+        R(s->isa.rd) = ((sword_t)R(s->isa.rs1) < (sword_t)R(s->isa.rs2) ? 1 : 0);
+        if (R(s->isa.rd) != 0) t->dnpc = t->pc + t->isa.imm);
+  FUSED(sltu_beq, sltu,
+        R(s->isa.rd) = (R(s->isa.rs1) < R(s->isa.rs2) ? 1 : 0);
+        if (R(s->isa.rd) == 0) t->dnpc = t->pc + t->isa.imm);
+  FUSED(sltu_bne, sltu,
+        R(s->isa.rd) = (R(s->isa.rs1) < R(s->isa.rs2) ? 1 : 0);
+        if (R(s->isa.rd) != 0) t->dnpc = t->pc + t->isa.imm);
+
+fuse_end:
+#endif
   R(0) = 0;  // reset $zero to 0
 
-  return 0;
+  return MUXDEF(CONFIG_ENGINE_THREADED, s - start + 1, 1);
 }
 
 int isa_exec_once(Decode *s) {
+#ifdef CONFIG_DECODE_CACHE
+  DCacheEntry *e = &dcache[DCACHE_IDX(s->pc)];
+  if (likely(e->pc == s->pc)) {
+    s->isa = e->isa;
+    s->snpc += 4;
+    return decode_exec(s);
+  }
+#endif
   s->isa.inst = inst_fetch(&s->snpc, 4);
+  s->isa.EHelper = NULL;
+  IFDEF(CONFIG_ENGINE_THREADED, blk_end = s + 1);
   return decode_exec(s);
 }
+
+#ifdef CONFIG_ENGINE_THREADED
+bool isa_decode_once(Decode *s) {
+  s->isa.inst = inst_fetch(&s->snpc, 4);
+  s->isa.EHelper = NULL;
+  decode_only = true;
+  bool end = decode_exec(s);
+  decode_only = false;
+  return end;
+}
+
+int isa_exec_block(Decode *s, int n) {
+  blk_end = s + n;
+  return decode_exec(s);
+}
+
+void isa_exec_block_stop() {
+  blk_end = NULL;
+  IFDEF(CONFIG_TCACHE_JIT, jit_stopped = true);
+}
+#endif
+
+#ifdef CONFIG_TCACHE_FUSION
+static int fuse_kind(Decode *a, Decode *b) {
+  uint32_t ia = a->isa.inst, ib = b->isa.inst;
+  int rd = a->isa.rd;
+  if (rd == 0) return -1;
+
+  uint32_t opa = BITS(ia, 6, 0), opb = BITS(ib, 6, 0), f3b = BITS(ib, 14, 12);
+  bool lui = (opa == 0b0110111), auipc = (opa == 0b0010111);
+  if ((lui || auipc) && b->isa.rs1 == rd) {
+    if (opb == 0b0010011 && f3b == 0b000) return lui ? FUSE_LUI_ADDI : FUSE_AUIPC_ADDI;
+    if (opb == 0b0000011 && f3b == 0b010) return lui ? FUSE_LUI_LW : FUSE_AUIPC_LW;
+    if (auipc && opb == 0b1100111 && f3b == 0b000) return FUSE_AUIPC_JALR;
+    return -1;
+  }
+
+  // slt/sltu followed by beq/bne comparing its result with $zero
+  bool slt = (opa == 0b0110011 && BITS(ia, 31, 25) == 0 && BITS(ia, 14, 13) == 0b01);
+  bool on_rd = (b->isa.rs1 == rd && b->isa.rs2 == 0) || (b->isa.rs1 == 0 && b->isa.rs2 == rd);
+  if (slt && opb == 0b1100011 && (f3b == 0b000 || f3b == 0b001) && on_rd) {
+    bool is_unsigned = BITS(ia, 12, 12);
+    bool is_bne = (f3b == 0b001);
+    return is_unsigned ? (is_bne ? FUSE_SLTU_BNE : FUSE_SLTU_BEQ) :
+                         (is_bne ? FUSE_SLT_BNE : FUSE_SLT_BEQ);
+  }
+  return -1;
+}
+
+void isa_fuse_block(Decode *s, int n) {
+  // the instructions in the block have been decoded
+  Assert(fused_body != NULL, "the block is not decoded");
+  for (int i = 0; i + 1 < n; i ++) {
+    int k = fuse_kind(&s[i], &s[i + 1]);
+    if (k >= 0) {
+      s[i].isa.EHelper = fused_body[k];
+      i ++;
+    }
+  }
+}
+#endif
+
+// jal/jalr ra, ...
+bool isa_inst_is_call(Decode *s) {
+  uint32_t i = s->isa.inst;
+  return (i & 0xfff) == 0x0ef || (i & 0x7fff) == 0x0e7;
+}
+
+// ret, i.e. jalr zero, 0(ra)
+bool isa_inst_is_ret(Decode *s) {
+  return s->isa.inst == 0x00008067;
+}
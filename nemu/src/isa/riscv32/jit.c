@@ -0,0 +1,396 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <isa.h>
+#include <cpu/decode.h>
+#include <memory/paddr.h>
+#include <memory/vaddr.h>
+#include <sys/mman.h>
+#include <stddef.h>
+
+#ifndef __x86_64__
+#error "the JIT only generates x86-64 code"
+#endif
+
+/* Translate a block of pre-decoded instructions into x86-64 code. The code
+ * is called as `int code()`, returns the number of guest instructions
+ * executed and leaves the next pc in `cpu.pc`.
+ *
+ * Guest registers live in `cpu` and are accessed through %rbx, which holds
+ * &cpu during the whole block. Loads and stores to pmem are done inline,
+ * while MMIO and stores to pages holding translated code go to the helpers
+ * below. Instructions not listed in jit_inst() are executed by calling the
+ * threaded engine with the pre-decoded instruction.
+ */
+
+#define JIT_CACHE_SIZE (16 * 1024 * 1024)
+#define JIT_MAX_INST_SIZE 256
+
+enum { EAX, ECX, EDX, EBX, ESP, EBP, ESI, EDI };
+enum { CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_A = 0x7, CC_L = 0xc, CC_GE = 0xd };
+
+#define GPR_OFF(i) ((int)(offsetof(CPU_state, gpr) + (i) * sizeof(cpu.gpr[0])))
+#define PC_OFF ((int)offsetof(CPU_state, pc))
+
+static uint8_t *jit_cache = NULL;
+static uint8_t *p = NULL; // where to emit the next byte
+
+// set by isa_exec_block_stop() when the running block is invalidated
+bool jit_stopped = false;
+
+/* ---------------- x86-64 emitter ---------------- */
+
+static inline void emit1(uint8_t b) { *p ++ = b; }
+static inline void emit4(uint32_t w) { memcpy(p, &w, 4); p += 4; }
+static inline void emit8(uint64_t d) { memcpy(p, &d, 8); p += 8; }
+
+// ModRM for [rbx + disp] with `reg` in the reg field
+static void emit_rbx_mem(int reg, int disp) {
+  if (disp < 128) { emit1(0x40 | (reg << 3) | EBX); emit1(disp); }
+  else { emit1(0x80 | (reg << 3) | EBX); emit4(disp); }
+}
+
+static void emit_load_gpr(int reg, int r) {
+  if (r == 0) { emit1(0x31); emit1(0xc0 | (reg << 3) | reg); return; } // xor reg, reg
+  emit1(0x8b); emit_rbx_mem(reg, GPR_OFF(r));                          // mov reg, gpr[r]
+}
+
+static void emit_store_gpr(int r, int reg) {
+  if (r == 0) return;
+  emit1(0x89); emit_rbx_mem(reg, GPR_OFF(r));                          // mov gpr[r], reg
+}
+
+static void emit_store_gpr_imm(int r, uint32_t imm) {
+  if (r == 0) return;
+  emit1(0xc7); emit_rbx_mem(0, GPR_OFF(r)); emit4(imm);                // mov gpr[r], imm
+}
+
+static void emit_mov_imm(int reg, uint32_t imm) { emit1(0xb8 + reg); emit4(imm); }
+static void emit_mov_imm64(int reg, uint64_t imm) { emit1(0x48); emit1(0xb8 + reg); emit8(imm); }
+static void emit_mov_rr(int dst, int src) { emit1(0x89); emit1(0xc0 | (src << 3) | dst); }
+
+// op dst, src with `op` being the opcode of the `r/m32, r32` form
+static void emit_alu_rr(uint8_t op, int dst, int src) { emit1(op); emit1(0xc0 | (src << 3) | dst); }
+
+// op reg, imm32 with `ext` being the opcode extension of 0x81
+static void emit_alu_ri(int ext, int reg, uint32_t imm) { emit1(0x81); emit1(0xc0 | (ext << 3) | reg); emit4(imm); }
+
+static void emit_shift_ri(int ext, int reg, uint8_t imm) { emit1(0xc1); emit1(0xc0 | (ext << 3) | reg); emit1(imm); }
+static void emit_shift_rcl(int ext, int reg) { emit1(0xd3); emit1(0xc0 | (ext << 3) | reg); }
+
+// eax = (eax cc ecx/imm) ? 1 : 0, the comparison is already emitted
+static void emit_setcc_eax(int cc) {
+  emit1(0x0f); emit1(0x90 | cc); emit1(0xc0);   // setcc al
+  emit1(0x0f); emit1(0xb6); emit1(0xc0);        // movzx eax, al
+}
+
+// return a pointer to the rel32 to patch
+static uint8_t *emit_jcc(int cc) { emit1(0x0f); emit1(0x80 | cc); emit4(0); return p - 4; }
+static uint8_t *emit_jmp() { emit1(0xe9); emit4(0); return p - 4; }
+static void patch_here(uint8_t *rel) { uint32_t off = p - (rel + 4); memcpy(rel, &off, 4); }
+
+static void emit_call(void *fn) {
+  emit_mov_imm64(EAX, (uintptr_t)fn);
+  emit1(0xff); emit1(0xd0);                     // call rax
+}
+
+// leave the block with `nr_exec` instructions executed, the next pc is set before
+static void emit_exit(int nr_exec) {
+  emit_mov_imm(EAX, nr_exec);
+  emit1(0x5b);                                  // pop rbx
+  emit1(0xc3);                                  // ret
+}
+
+static void emit_exit_pc(vaddr_t pc, int nr_exec) {
+  emit1(0xc7); emit_rbx_mem(0, PC_OFF); emit4(pc);
+  emit_exit(nr_exec);
+}
+
+/* ---------------- helpers called by the generated code ---------------- */
+
+static word_t jit_load(vaddr_t addr, int len) {
+  return vaddr_read(addr, len);
+}
+
+// return true if the running block is invalidated by this store
+static int jit_store(vaddr_t addr, int len, word_t data) {
+  jit_stopped = false;
+  vaddr_write(addr, len, data);
+  return jit_stopped;
+}
+
+static vaddr_t jit_exec_inst(Decode *s) {
+  isa_exec_block(s, 1);
+  return s->dnpc;
+}
+
+/* ---------------- translation ---------------- */
+
+// eax = rs1 + imm, then edx = eax - MBASE if the access can go to pmem
+// directly, otherwise jump to the slow path through the returned jumps
+static int emit_addr_check(Decode *s, int len, uint8_t **slow) {
+  int nr_slow = 0;
+  emit_load_gpr(EAX, s->isa.rs1);
+  if (s->isa.imm != 0) emit_alu_ri(0, EAX, s->isa.imm);               // add eax, imm
+  // with paging, always translate through the helpers; the code cache is
+  // flushed whenever satp is written
+  if (isa_mmu_check(0, len, MEM_TYPE_READ) == MMU_TRANSLATE) {
+    slow[nr_slow ++] = emit_jmp();
+    return nr_slow;
+  }
+  emit_mov_rr(EDX, EAX);
+  emit_alu_ri(5, EDX, CONFIG_MBASE);                                   // sub edx, MBASE
+  emit_alu_ri(7, EDX, CONFIG_MSIZE - len);                             // cmp edx, MSIZE - len
+  slow[nr_slow ++] = emit_jcc(CC_A);
+  if (len > 1) {
+    // a misaligned access may cross the page
+    emit1(0xa9); emit4(len - 1);                                       // test eax, len - 1
+    slow[nr_slow ++] = emit_jcc(CC_NE);
+  }
+  return nr_slow;
+}
+
+static void emit_load(Decode *s, int len, bool sign) {
+  uint8_t *slow[2];
+  int nr_slow = emit_addr_check(s, len, slow);
+  emit_mov_imm64(ECX, (uintptr_t)guest_to_host(CONFIG_MBASE));
+  switch (len) {                                                       // eax = [rcx + rdx]
+    case 1: emit1(0x0f); emit1(sign ? 0xbe : 0xb6); break;
+    case 2: emit1(0x0f); emit1(sign ? 0xbf : 0xb7); break;
+    case 4: emit1(0x8b); break;
+  }
+  emit1(0x04); emit1(0x11);
+  uint8_t *done = emit_jmp();
+
+  for (int i = 0; i < nr_slow; i ++) patch_here(slow[i]);
+  emit_mov_rr(EDI, EAX);
+  emit_mov_imm(ESI, len);
+  emit_call(jit_load);
+  switch (len) {                                                       // extend eax
+    case 1: emit1(0x0f); emit1(sign ? 0xbe : 0xb6); emit1(0xc0); break;
+    case 2: emit1(0x0f); emit1(sign ? 0xbf : 0xb7); emit1(0xc0); break;
+  }
+  patch_here(done);
+  emit_store_gpr(s->isa.rd, EAX);
+}
+
+static void emit_store(Decode *s, int len, int idx) {
+  uint8_t *slow[3];
+  int nr_slow = emit_addr_check(s, len, slow);
+  // the page must be dirty for all clients, e.g. not hold translated code
+  emit_mov_rr(ESI, EDX);
+  emit_shift_ri(5, ESI, PAGE_SHIFT);                                   // shr esi, PAGE_SHIFT
+  emit_mov_imm64(EDI, (uintptr_t)paddr_dirty_map());
+  emit1(0x80); emit1(0x3c); emit1(0x37); emit1(DIRTY_ALL);             // cmp byte [rdi + rsi], DIRTY_ALL
+  slow[nr_slow ++] = emit_jcc(CC_NE);
+  emit_load_gpr(ECX, s->isa.rs2);
+  emit_mov_imm64(EDI, (uintptr_t)guest_to_host(CONFIG_MBASE));
+  switch (len) {                                                       // [rdi + rdx] = ecx
+    case 1: emit1(0x88); break;
+    case 2: emit1(0x66); emit1(0x89); break;
+    case 4: emit1(0x89); break;
+  }
+  emit1(0x0c); emit1(0x17);
+  uint8_t *done = emit_jmp();
+
+  for (int i = 0; i < nr_slow; i ++) patch_here(slow[i]);
+  emit_mov_rr(EDI, EAX);
+  emit_mov_imm(ESI, len);
+  emit_load_gpr(EDX, s->isa.rs2);
+  emit_call(jit_store);
+  emit1(0x85); emit1(0xc0);                                            // test eax, eax
+  uint8_t *cont = emit_jcc(CC_E);
+  emit_exit_pc(s->snpc, idx + 1);
+  patch_here(cont);
+  patch_here(done);
+}
+
+static void emit_branch(Decode *s, int cc, int nr_exec) {
+  emit_load_gpr(EAX, s->isa.rs1);
+  emit_load_gpr(ECX, s->isa.rs2);
+  emit_alu_rr(0x39, EAX, ECX);                                         // cmp eax, ecx
+  uint8_t *taken = emit_jcc(cc);
+  emit_exit_pc(s->snpc, nr_exec);
+  patch_here(taken);
+  emit_exit_pc(s->pc + s->isa.imm, nr_exec);
+}
+
+static void emit_fallback(Decode *s, bool last, int nr_exec) {
+  emit_mov_imm64(EDI, (uintptr_t)s);
+  emit_call(jit_exec_inst);
+  if (last) {
+    emit1(0x89); emit_rbx_mem(EAX, PC_OFF);                            // mov cpu.pc, eax
+    emit_exit(nr_exec);
+  }
+}
+
+// eax = rs1 op (rs2 or imm), then rd = eax
+static void emit_alu(Decode *s, bool is_imm, int op_rr, int ext_ri) {
+  emit_load_gpr(EAX, s->isa.rs1);
+  if (is_imm) emit_alu_ri(ext_ri, EAX, s->isa.imm);
+  else { emit_load_gpr(ECX, s->isa.rs2); emit_alu_rr(op_rr, EAX, ECX); }
+  emit_store_gpr(s->isa.rd, EAX);
+}
+
+static void emit_shift(Decode *s, bool is_imm, int ext) {
+  emit_load_gpr(EAX, s->isa.rs1);
+  if (is_imm) emit_shift_ri(ext, EAX, s->isa.imm & 0x1f);
+  else { emit_load_gpr(ECX, s->isa.rs2); emit_shift_rcl(ext, EAX); }
+  emit_store_gpr(s->isa.rd, EAX);
+}
+
+static void emit_slt(Decode *s, bool is_imm, int cc) {
+  emit_load_gpr(EAX, s->isa.rs1);
+  if (is_imm) emit_alu_ri(7, EAX, s->isa.imm);
+  else { emit_load_gpr(ECX, s->isa.rs2); emit_alu_rr(0x39, EAX, ECX); }
+  emit_setcc_eax(cc);
+  emit_store_gpr(s->isa.rd, EAX);
+}
+
+// edx:eax = eax * ecx
+static void emit_mul(Decode *s, int ext, bool high) {
+  emit_load_gpr(EAX, s->isa.rs1);
+  emit_load_gpr(ECX, s->isa.rs2);
+  if (high) { emit1(0xf7); emit1(0xc0 | (ext << 3) | ECX); emit_store_gpr(s->isa.rd, EDX); }
+  else { emit1(0x0f); emit1(0xaf); emit1(0xc1); emit_store_gpr(s->isa.rd, EAX); }
+}
+
+/* Translate the `idx`-th instruction of a block with `n` instructions.
+ * Return false if it is not supported, then it is executed by the helper. */
+static bool jit_inst(Decode *s, int idx, int n) {
+  uint32_t i = s->isa.inst;
+  uint32_t opcode = BITS(i, 6, 0), funct3 = BITS(i, 14, 12), funct7 = BITS(i, 31, 25);
+  bool last = (idx == n - 1);
+  word_t imm = s->isa.imm;
+
+  switch (opcode) {
+    case 0b0110111: emit_store_gpr_imm(s->isa.rd, imm); break;         // lui
+    case 0b0010111: emit_store_gpr_imm(s->isa.rd, s->pc + imm); break; // auipc
+    case 0b1101111:                                                    // jal
+      emit_store_gpr_imm(s->isa.rd, s->snpc);
+      emit_exit_pc(s->pc + imm, n);
+      return true;
+    case 0b1100111:                                                    // jalr
+      if (funct3 != 0) return false;
+      emit_load_gpr(EAX, s->isa.rs1);
+      if (imm != 0) emit_alu_ri(0, EAX, imm);
+      emit_alu_ri(4, EAX, ~1u);                                        // and eax, ~1
+      emit_store_gpr_imm(s->isa.rd, s->snpc);
+      emit1(0x89); emit_rbx_mem(EAX, PC_OFF);
+      emit_exit(n);
+      return true;
+    case 0b1100011:                                                    // branch
+      switch (funct3) {
+        case 0b000: emit_branch(s, CC_E, n); return true;
+        case 0b001: emit_branch(s, CC_NE, n); return true;
+        case 0b100: emit_branch(s, CC_L, n); return true;
+        case 0b101: emit_branch(s, CC_GE, n); return true;
+        case 0b110: emit_branch(s, CC_B, n); return true;
+        case 0b111: emit_branch(s, CC_AE, n); return true;
+        default: return false;
+      }
+    case 0b0000011:                                                    // load
+      switch (funct3) {
+        case 0b000: emit_load(s, 1, true); break;
+        case 0b001: emit_load(s, 2, true); break;
+        case 0b010: emit_load(s, 4, false); break;
+        case 0b100: emit_load(s, 1, false); break;
+        case 0b101: emit_load(s, 2, false); break;
+        default: return false;
+      }
+      break;
+    case 0b0100011:                                                    // store
+      switch (funct3) {
+        case 0b000: emit_store(s, 1, idx); break;
+        case 0b001: emit_store(s, 2, idx); break;
+        case 0b010: emit_store(s, 4, idx); break;
+        default: return false;
+      }
+      break;
+    case 0b0010011:                                                    // op-imm
+      switch (funct3) {
+        case 0b000: emit_alu(s, true, 0, 0); break;                    // addi
+        case 0b010: emit_slt(s, true, CC_L); break;                    // slti
+        case 0b011: emit_slt(s, true, CC_B); break;                    // sltiu
+        case 0b100: emit_alu(s, true, 0, 6); break;                    // xori
+        case 0b110: emit_alu(s, true, 0, 1); break;                    // ori
+        case 0b111: emit_alu(s, true, 0, 4); break;                    // andi
+        case 0b001:                                                    // slli
+          if (funct7 != 0) return false;
+          emit_shift(s, true, 4); break;
+        case 0b101:
+          if (funct7 == 0) emit_shift(s, true, 5);                     // srli
+          else if (funct7 == 0b0100000) emit_shift(s, true, 7);        // srai
+          else return false;
+          break;
+      }
+      break;
+    case 0b0110011:                                                    // op
+      if (funct7 == 0) {
+        switch (funct3) {
+          case 0b000: emit_alu(s, false, 0x01, 0); break;              // add
+          case 0b001: emit_shift(s, false, 4); break;                  // sll
+          case 0b010: emit_slt(s, false, CC_L); break;                 // slt
+          case 0b011: emit_slt(s, false, CC_B); break;                 // sltu
+          case 0b100: emit_alu(s, false, 0x31, 0); break;              // xor
+          case 0b101: emit_shift(s, false, 5); break;                  // srl
+          case 0b110: emit_alu(s, false, 0x09, 0); break;              // or
+          case 0b111: emit_alu(s, false, 0x21, 0); break;              // and
+        }
+      } else if (funct7 == 0b0100000) {
+        switch (funct3) {
+          case 0b000: emit_alu(s, false, 0x29, 0); break;              // sub
+          case 0b101: emit_shift(s, false, 7); break;                  // sra
+          default: return false;
+        }
+      } else if (funct7 == 0b0000001) {
+        switch (funct3) {
+          case 0b000: emit_mul(s, 0, false); break;                    // mul
+          case 0b001: emit_mul(s, 5, true); break;                     // mulh
+          case 0b011: emit_mul(s, 4, true); break;                     // mulhu
+          default: return false;                                       // div and rem
+        }
+      } else return false;
+      break;
+    default: return false;
+  }
+
+  if (last) emit_exit_pc(s->snpc, n);
+  return true;
+}
+
+void *isa_jit_translate(Decode *s, int n) {
+  if (jit_cache == NULL) {
+    jit_cache = mmap(NULL, JIT_CACHE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    Assert(jit_cache != MAP_FAILED, "cannot allocate the code cache for JIT");
+    p = jit_cache;
+  }
+  if (p + n * JIT_MAX_INST_SIZE + 16 > jit_cache + JIT_CACHE_SIZE) return NULL;
+
+  uint8_t *code = p;
+  emit1(0x53);                                                         // push rbx
+  emit_mov_imm64(EBX, (uintptr_t)&cpu);
+  for (int i = 0; i < n; i ++) {
+    uint8_t *start = p;
+    if (!jit_inst(&s[i], i, n)) emit_fallback(&s[i], i == n - 1, n);
+    Assert(p - start <= JIT_MAX_INST_SIZE, "code of inst at pc = " FMT_WORD " is too long", s[i].pc);
+  }
+  return code;
+}
+
+void isa_jit_reset() {
+  p = jit_cache;
+}
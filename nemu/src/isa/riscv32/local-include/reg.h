@@ -30,4 +30,11 @@ static inline const char* reg_name(int idx) {
   return regs[check_reg_idx(idx)];
 }
 
+#define CSR_SATP 0x180
+
+word_t csr_read(word_t no);
+void csr_write(word_t no, word_t val);
+// drop the cached translations and code, on satp writes and sfence.vma
+void mmu_flush();
+
 #endif
@@ -43,21 +43,36 @@ void isa_reg_display() {
     printf("%-15s %-15x %-15d\n", regs[i], cpu.gpr[i], cpu.gpr[i]);
   #endif
   }
+  printf("%-15s " FMT_WORD "\n", "satp", cpu.satp);
 }
 
-word_t isa_reg_str2val(const char *s, bool *success) {
-  if (strcmp(s, "pc") == 0) {
-    *success = true;
-    return cpu.pc;
-  }
+word_t *isa_reg_str2ptr(const char *s) {
+  if (strcmp(s, "pc") == 0) return &cpu.pc;
+  if (strcmp(s, "satp") == 0) return &cpu.satp;
 
   for (int i = 0; i < NR_REGS_TABLE; i++) {
-    if (strcmp(s, regs[i]) == 0) {
-      *success = true;
-      return cpu.gpr[i];
-    }
+    if (strcmp(s, regs[i]) == 0) return &cpu.gpr[i];
+  }
+  return NULL;
+}
+
+word_t isa_reg_str2val(const char *s, bool *success) {
+  word_t *p = isa_reg_str2ptr(s);
+  *success = (p != NULL);
+  return (p != NULL ? *p : 0);
+}
+
+word_t csr_read(word_t no) {
+  switch (no & 0xfff) {
+    case CSR_SATP: return cpu.satp;
+    default: panic("unsupported CSR 0x%03x at pc = " FMT_WORD, (int)(no & 0xfff), cpu.pc);
   }
-  
-  *success = false;
   return 0;
 }
+
+void csr_write(word_t no, word_t val) {
+  switch (no & 0xfff) {
+    case CSR_SATP: cpu.satp = val; mmu_flush(); break;
+    default: panic("unsupported CSR 0x%03x at pc = " FMT_WORD, (int)(no & 0xfff), cpu.pc);
+  }
+}
@@ -16,7 +16,44 @@
 #include <isa.h>
 #include <memory/vaddr.h>
 #include <memory/paddr.h>
+#include <cpu/cpu.h>
+#include "../local-include/reg.h"
 
+enum { PTE_V = 0x01, PTE_R = 0x02, PTE_W = 0x04, PTE_X = 0x08, PTE_A = 0x40, PTE_D = 0x80 };
+
+/* Walk the Sv32 page table. Return the physical page with MEM_RET_OK in the
+ * low bits, or MEM_RET_FAIL on a page fault. The accessed and dirty bits are
+ * updated by the walker. There are no privilege modes, so the U bit is not
+ * checked.
+ */
 paddr_t isa_mmu_translate(vaddr_t vaddr, int len, int type) {
+  paddr_t base = (paddr_t)BITS(cpu.satp, 21, 0) << PAGE_SHIFT;
+  for (int level = 1; level >= 0; level --) {
+    paddr_t pte_addr = base + BITS(vaddr, 21 + level * 10, 12 + level * 10) * 4;
+    word_t pte = paddr_read(pte_addr, 4);
+    if (!(pte & PTE_V) || ((pte & PTE_W) && !(pte & PTE_R))) return MEM_RET_FAIL;
+    paddr_t ppage = (paddr_t)BITS(pte, 31, 10) << PAGE_SHIFT;
+    if (!(pte & (PTE_R | PTE_X))) {
+      base = ppage;
+      continue;
+    }
+
+    int perm = (type == MEM_TYPE_IFETCH ? PTE_X : type == MEM_TYPE_READ ? PTE_R : PTE_W);
+    if (!(pte & perm)) return MEM_RET_FAIL;
+    if (level == 1) {
+      // a superpage must be aligned to 4MB
+      if (BITS(pte, 19, 10) != 0) return MEM_RET_FAIL;
+      ppage |= vaddr & 0x3ff000;
+    }
+    word_t new_pte = pte | PTE_A | (type == MEM_TYPE_WRITE ? PTE_D : 0);
+    if (new_pte != pte) paddr_write(pte_addr, 4, new_pte);
+    return ppage | MEM_RET_OK;
+  }
   return MEM_RET_FAIL;
 }
+
+void mmu_flush() {
+  tlb_flush();
+  IFDEF(CONFIG_DECODE_CACHE, isa_dcache_flush());
+  IFDEF(CONFIG_ENGINE_THREADED, tcache_flush());
+}
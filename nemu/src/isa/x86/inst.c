@@ -217,3 +217,22 @@ again:
 
   return 0;
 }
+
+// the opcode after the operand size prefix
+static uint8_t *x86_opcode(Decode *s) {
+  uint8_t *p = s->isa.inst;
+  while (*p == 0x66) p ++;
+  return p;
+}
+
+// call rel, or call r/m
+bool isa_inst_is_call(Decode *s) {
+  uint8_t *p = x86_opcode(s);
+  return p[0] == 0xe8 || (p[0] == 0xff && ((ModR_M *)&p[1])->opcode == 2);
+}
+
+// ret, or ret imm16
+bool isa_inst_is_ret(Decode *s) {
+  uint8_t *p = x86_opcode(s);
+  return p[0] == 0xc3 || p[0] == 0xc2;
+}
@@ -15,10 +15,17 @@
 
 #include <memory/host.h>
 #include <memory/paddr.h>
+#include <memory/vaddr.h>
 #include <device/mmio.h>
 #include <isa.h>
+#include <cpu/cpu.h>
+#include <unistd.h>
+#ifdef CONFIG_PMEM_MMAP
+#include <sys/mman.h>
+#include <signal.h>
+#endif
 
-#if   defined(CONFIG_PMEM_MALLOC)
+#if   defined(CONFIG_PMEM_MALLOC) || defined(CONFIG_PMEM_MMAP)
 static uint8_t *pmem = NULL;
 #else // CONFIG_PMEM_GARRAY
 static uint8_t pmem[CONFIG_MSIZE] PG_ALIGN = {};
@@ -32,7 +39,50 @@ static word_t pmem_read(paddr_t addr, int len) {
   return ret;
 }
 
+/* One byte of dirty flags per page of pmem, one bit per client. A write to
+ * the page sets all of the bits, and a client clears its bit when it has
+ * consumed the page. The store path then only compares the byte with
+ * DIRTY_ALL, and takes the slow path at the first write after a clear.
+ *
+ * For DIRTY_CODE, a clear bit means the page holds cached code, which is
+ * invalidated at the next write to the page.
+ *
+ * DIRTY_WATCH is clear while the page is watched, and a write does not set
+ * it. Every write to a watched page then takes the slow path, where it is
+ * passed to the watch handler.
+ */
+static uint8_t dirty_page[CONFIG_MSIZE >> PAGE_SHIFT] = {};
+
+const uint8_t *paddr_dirty_map() {
+  return dirty_page;
+}
+
+static void (*watch_handler)(paddr_t addr, int len, word_t data) = NULL;
+
+void paddr_set_watch_handler(void (*handler)(paddr_t addr, int len, word_t data)) {
+  watch_handler = handler;
+}
+
+static void page_dirtied(paddr_t addr, uint8_t *d) {
+  uint8_t old = *d;
+  *d = DIRTY_ALL & (old | ~DIRTY_BIT(DIRTY_WATCH));
+  if (!(old & DIRTY_BIT(DIRTY_CODE))) {
+    IFDEF(CONFIG_DECODE_CACHE, isa_dcache_invalidate(addr & ~PAGE_MASK));
+    IFDEF(CONFIG_ENGINE_THREADED, tcache_invalidate(addr & ~PAGE_MASK));
+  }
+}
+
+static void pmem_write_slow(paddr_t addr, int len, word_t data, uint8_t *d, uint8_t *d2) {
+  bool watched = !(*d & *d2 & DIRTY_BIT(DIRTY_WATCH));
+  if (*d != DIRTY_ALL) page_dirtied(addr, d);
+  if (*d2 != DIRTY_ALL && d2 != d) page_dirtied(addr + len - 1, d2);
+  if (watched && watch_handler != NULL) watch_handler(addr, len, data);
+}
+
 static void pmem_write(paddr_t addr, int len, word_t data) {
+  uint8_t *d = &dirty_page[(addr - CONFIG_MBASE) >> PAGE_SHIFT];
+  uint8_t *d2 = &dirty_page[(addr + len - 1 - CONFIG_MBASE) >> PAGE_SHIFT];
+  if (unlikely((*d & *d2) != DIRTY_ALL)) pmem_write_slow(addr, len, data, d, d2);
   host_write(guest_to_host(addr), len, data);
 }
 
@@ -41,12 +91,137 @@ static void out_of_bound(paddr_t addr) {
       addr, PMEM_LEFT, PMEM_RIGHT, cpu.pc);
 }
 
+#ifdef CONFIG_PMEM_MMAP
+/* Pmem is reserved without committing any page, and aligned to the size
+ * of a huge page, so that it can be backed by huge pages.
+ *
+ * With MEM_RANDOM, pmem starts inaccessible. The first access to a page
+ * raises SIGSEGV, then the handler makes the page accessible and fills it,
+ * and the access is restarted. Memory written by the host kernel, e.g. by
+ * read(2), must be committed with pmem_commit() before. Pages loaded from
+ * a file by pmem_load() are mapped in place and never fault.
+ *
+ * A page accessible between two inaccessible ones is a mapping of its
+ * own, so at most CONFIG_MSIZE / PAGE_SIZE / 2 mappings are needed.
+ */
+#define PMEM_ALIGN (2ul * 1024 * 1024)
+
+#ifdef CONFIG_MEM_RANDOM
+static uint8_t fill_byte = 0;
+static struct sigaction old_segv_action;
+
+static void commit_page(uint8_t *haddr) {
+  uint8_t *page = pmem + ((haddr - pmem) & ~PAGE_MASK);
+  int ret = mprotect(page, PAGE_SIZE, PROT_READ | PROT_WRITE);
+  Assert(ret == 0, "cannot commit pmem at " FMT_PADDR ", is vm.max_map_count too small?",
+      host_to_guest(page));
+  memset(page, fill_byte, PAGE_SIZE);
+}
+
+static void segv_handler(int sig, siginfo_t *info, void *ucontext) {
+  uint8_t *haddr = info->si_addr;
+  if (haddr >= pmem && haddr < pmem + CONFIG_MSIZE) {
+    commit_page(haddr);
+    return;
+  }
+  // not a fault on pmem, pass it to the previous handler
+  if (old_segv_action.sa_flags & SA_SIGINFO) {
+    old_segv_action.sa_sigaction(sig, info, ucontext);
+  } else if (old_segv_action.sa_handler != SIG_DFL && old_segv_action.sa_handler != SIG_IGN) {
+    old_segv_action.sa_handler(sig);
+  } else {
+    // crash as usual when the access is restarted
+    signal(SIGSEGV, SIG_DFL);
+  }
+}
+#endif
+
+static void init_pmem_mmap() {
+  // reserve more to align pmem
+  size_t size = CONFIG_MSIZE + PMEM_ALIGN;
+  int prot = MUXDEF(CONFIG_MEM_RANDOM, PROT_NONE, PROT_READ | PROT_WRITE);
+  uint8_t *p = mmap(NULL, size, prot, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  Assert(p != MAP_FAILED, "cannot reserve %ld bytes for pmem", (long)CONFIG_MSIZE);
+  pmem = (uint8_t *)(((uintptr_t)p + PMEM_ALIGN - 1) & ~(PMEM_ALIGN - 1));
+  madvise(pmem, CONFIG_MSIZE, MADV_HUGEPAGE);
+
+#ifdef CONFIG_MEM_RANDOM
+  fill_byte = rand();
+  struct sigaction sa = {};
+  sa.sa_sigaction = segv_handler;
+  sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+  sigemptyset(&sa.sa_mask);
+  int ret = sigaction(SIGSEGV, &sa, &old_segv_action);
+  Assert(ret == 0, "cannot install the handler for SIGSEGV");
+#endif
+}
+#endif
+
+void pmem_commit(paddr_t addr, size_t len) {
+#if defined(CONFIG_PMEM_MMAP) && defined(CONFIG_MEM_RANDOM)
+  // a volatile read faults in the page if it is not committed yet
+  for (size_t off = 0; off < len; off += PAGE_SIZE) {
+    (void)*(volatile uint8_t *)guest_to_host(addr + off);
+  }
+  if (len > 0) (void)*(volatile uint8_t *)guest_to_host(addr + len - 1);
+#endif
+}
+
+// copy [off, off + len) of `fd`, or zeros if `fd` < 0
+static void pmem_copy(paddr_t addr, size_t len, int fd, off_t off) {
+  if (len == 0) return;
+  pmem_commit(addr, len);
+  if (fd < 0) { memset(guest_to_host(addr), 0, len); return; }
+  ssize_t ret = pread(fd, guest_to_host(addr), len, off);
+  Assert(ret == len, "can not read %zu bytes from the file at offset %ld", len, (long)off);
+}
+
+#ifdef CONFIG_PMEM_MMAP
+// map the whole pages in [addr, addr + len), which must be page aligned
+static void pmem_map(paddr_t addr, size_t len, int fd, off_t off) {
+  if (len == 0) return;
+  int prot = PROT_READ | PROT_WRITE;
+  void *p = (fd < 0 ? mmap(guest_to_host(addr), len, prot, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0)
+                    : mmap(guest_to_host(addr), len, prot, MAP_PRIVATE | MAP_FIXED, fd, off));
+  Assert(p != MAP_FAILED, "can not map the file to pmem at " FMT_PADDR, addr);
+}
+#endif
+
+void pmem_load(paddr_t addr, size_t len, int fd, off_t off) {
+  // e.g. a segment without bss, which may end at the end of pmem
+  if (len == 0) return;
+  Assert(in_pmem(addr) && len <= PMEM_RIGHT - addr + 1,
+      "[" FMT_PADDR ", " FMT_PADDR ") is out of bound of pmem", addr, addr + (paddr_t)len);
+#ifdef CONFIG_PMEM_MMAP
+  // only the pages with the same offset in the file can be mapped
+  if (fd < 0 || ((addr ^ off) & PAGE_MASK) == 0) {
+    paddr_t left = (addr + PAGE_MASK) & ~PAGE_MASK;
+    paddr_t right = (addr + len) & ~PAGE_MASK;
+    if (left < right && left - addr < len) {
+      pmem_copy(addr, left - addr, fd, off);
+      pmem_map(left, right - left, fd, off + (left - addr));
+      pmem_copy(right, addr + len - right, fd, off + (right - addr));
+      paddr_dirty_set(addr, len);
+      return;
+    }
+  }
+#endif
+  pmem_copy(addr, len, fd, off);
+  paddr_dirty_set(addr, len);
+}
+
 void init_mem() {
 #if   defined(CONFIG_PMEM_MALLOC)
   pmem = malloc(CONFIG_MSIZE);
   assert(pmem);
+#elif defined(CONFIG_PMEM_MMAP)
+  init_pmem_mmap();
+#endif
+#if defined(CONFIG_MEM_RANDOM) && !defined(CONFIG_PMEM_MMAP)
+  memset(pmem, rand(), CONFIG_MSIZE);
 #endif
-  IFDEF(CONFIG_MEM_RANDOM, memset(pmem, rand(), CONFIG_MSIZE));
+  memset(dirty_page, DIRTY_ALL, sizeof(dirty_page));
+  tlb_flush();
   Log("physical memory area [" FMT_PADDR ", " FMT_PADDR "]", PMEM_LEFT, PMEM_RIGHT);
 }
 
@@ -62,3 +237,43 @@ void paddr_write(paddr_t addr, int len, word_t data) {
   IFDEF(CONFIG_DEVICE, mmio_write(addr, len, data); return);
   out_of_bound(addr);
 }
+
+static uint8_t *dirty_flags(paddr_t addr) {
+  if (in_pmem(addr)) return &dirty_page[(addr - CONFIG_MBASE) >> PAGE_SHIFT];
+  return MUXDEF(CONFIG_DEVICE, mmio_dirty_flags(addr), NULL);
+}
+
+#define for_each_page(page, addr, len) \
+  for (paddr_t page = (addr) & ~PAGE_MASK; page - ((addr) & ~PAGE_MASK) < (len); page += PAGE_SIZE)
+
+bool paddr_dirty_test(paddr_t addr, size_t len, int client) {
+  for_each_page(page, addr, len) {
+    uint8_t *d = dirty_flags(page);
+    if (d != NULL && (*d & DIRTY_BIT(client))) return true;
+  }
+  return false;
+}
+
+void paddr_dirty_clear(paddr_t addr, size_t len, int client) {
+  for_each_page(page, addr, len) {
+    uint8_t *d = dirty_flags(page);
+    if (d != NULL) *d &= ~DIRTY_BIT(client);
+  }
+}
+
+void paddr_dirty_set(paddr_t addr, size_t len) {
+  for_each_page(page, addr, len) {
+    uint8_t *d = dirty_flags(page);
+    if (d != NULL && *d != DIRTY_ALL) {
+      if (in_pmem(page)) page_dirtied(page, d);
+      else *d = DIRTY_ALL;
+    }
+  }
+}
+
+void paddr_watch_page(paddr_t addr, bool watch) {
+  if (!in_pmem(addr)) return;
+  uint8_t *d = &dirty_page[(addr - CONFIG_MBASE) >> PAGE_SHIFT];
+  if (watch) *d &= ~DIRTY_BIT(DIRTY_WATCH);
+  else *d |= DIRTY_BIT(DIRTY_WATCH);
+}
@@ -14,16 +14,131 @@
 ***************************************************************************************/
 
 #include <isa.h>
+#include <memory/host.h>
 #include <memory/paddr.h>
+#include <memory/vaddr.h>
+
+/* A software TLB in front of isa_mmu_translate(). It is direct-mapped by the
+ * virtual page number, with separate arrays for instruction fetches and data
+ * accesses. For pages in pmem, the host address of the page is cached, so
+ * that an access which hits goes to the host memory directly. Other pages
+ * (e.g. MMIO) only cache the physical page and go through paddr_read/write.
+ *
+ * A data entry filled by a read does not grant writing, since the page table
+ * walk for a write also checks the permission and sets the dirty bit.
+ */
+
+#define TLB_SIZE 256
+#define TLB_IDX(vpn) ((vpn) & (TLB_SIZE - 1))
+#define TLB_INVALID ((vaddr_t)-1)
+
+typedef struct {
+  vaddr_t vpn;
+  paddr_t ppage;
+  uint8_t *host;      // host address of the page, or NULL if not in pmem
+  bool writable;
+} TLBEntry;
+
+static TLBEntry itlb[TLB_SIZE] = {}, dtlb[TLB_SIZE] = {};
+
+static const uint8_t *dirty_map = NULL;
+
+void tlb_flush() {
+  for (int i = 0; i < TLB_SIZE; i ++) {
+    itlb[i].vpn = TLB_INVALID;
+    dtlb[i].vpn = TLB_INVALID;
+  }
+}
+
+static inline bool cross_page(vaddr_t addr, int len) {
+  return (addr & PAGE_MASK) + len > PAGE_SIZE;
+}
+
+static TLBEntry *tlb_fill(TLBEntry *tlb, vaddr_t addr, int type) {
+  paddr_t ret = isa_mmu_translate(addr, 1, type);
+  Assert((ret & PAGE_MASK) == MEM_RET_OK, "%s page fault at vaddr = " FMT_WORD ", pc = " FMT_WORD,
+      (type == MEM_TYPE_IFETCH ? "instruction" : type == MEM_TYPE_READ ? "load" : "store"),
+      addr, cpu.pc);
+  vaddr_t vpn = addr >> PAGE_SHIFT;
+  TLBEntry *e = &tlb[TLB_IDX(vpn)];
+  e->vpn = vpn;
+  e->ppage = ret & ~PAGE_MASK;
+  e->host = (in_pmem(e->ppage) ? guest_to_host(e->ppage) : NULL);
+  e->writable = (type == MEM_TYPE_WRITE);
+  return e;
+}
+
+static inline TLBEntry *tlb_lookup(TLBEntry *tlb, vaddr_t addr, int type) {
+  vaddr_t vpn = addr >> PAGE_SHIFT;
+  TLBEntry *e = &tlb[TLB_IDX(vpn)];
+  if (likely(e->vpn == vpn && (type != MEM_TYPE_WRITE || e->writable))) return e;
+  return tlb_fill(tlb, addr, type);
+}
+
+paddr_t vaddr_to_paddr(vaddr_t addr, int type) {
+  if (isa_mmu_check(addr, 1, type) == MMU_DIRECT) return addr;
+  TLBEntry *e = tlb_lookup(type == MEM_TYPE_IFETCH ? itlb : dtlb, addr, type);
+  return e->ppage | (addr & PAGE_MASK);
+}
+
+// split an access crossing a page into bytes, each of them is translated
+static word_t cross_page_read(vaddr_t addr, int len, int type) {
+  word_t data = 0;
+  for (int i = 0; i < len; i ++) {
+    data |= (word_t)paddr_read(vaddr_to_paddr(addr + i, type), 1) << (i * 8);
+  }
+  return data;
+}
+
+static word_t translate_read(TLBEntry *tlb, vaddr_t addr, int len, int type) {
+  if (unlikely(cross_page(addr, len))) return cross_page_read(addr, len, type);
+  TLBEntry *e = tlb_lookup(tlb, addr, type);
+  if (likely(e->host != NULL)) return host_read(e->host + (addr & PAGE_MASK), len);
+  return paddr_read(e->ppage | (addr & PAGE_MASK), len);
+}
 
 word_t vaddr_ifetch(vaddr_t addr, int len) {
-  return paddr_read(addr, len);
+  if (isa_mmu_check(addr, len, MEM_TYPE_IFETCH) == MMU_DIRECT) return paddr_read(addr, len);
+  return translate_read(itlb, addr, len, MEM_TYPE_IFETCH);
+}
+
+#ifdef CONFIG_MTRACE
+// only data accesses are traced, by their physical addresses
+static inline void mtrace_access(vaddr_t addr, int len, word_t data, int type) {
+  if (likely(!mtrace_on)) return;
+  mtrace_record(cpu.pc, vaddr_to_paddr(addr, type), len, data, type == MEM_TYPE_WRITE);
+}
+#endif
+
+static inline word_t data_read(vaddr_t addr, int len) {
+  if (isa_mmu_check(addr, len, MEM_TYPE_READ) == MMU_DIRECT) return paddr_read(addr, len);
+  return translate_read(dtlb, addr, len, MEM_TYPE_READ);
 }
 
 word_t vaddr_read(vaddr_t addr, int len) {
-  return paddr_read(addr, len);
+  word_t data = data_read(addr, len);
+  IFDEF(CONFIG_MTRACE, mtrace_access(addr, len, data, MEM_TYPE_READ));
+  return data;
+}
+
+static inline void data_write(vaddr_t addr, int len, word_t data) {
+  if (isa_mmu_check(addr, len, MEM_TYPE_WRITE) == MMU_DIRECT) { paddr_write(addr, len, data); return; }
+  if (unlikely(cross_page(addr, len))) {
+    for (int i = 0; i < len; i ++) {
+      paddr_write(vaddr_to_paddr(addr + i, MEM_TYPE_WRITE), 1, data >> (i * 8));
+    }
+    return;
+  }
+  TLBEntry *e = tlb_lookup(dtlb, addr, MEM_TYPE_WRITE);
+  // a page not dirty for some client must be written through pmem to track it
+  bool direct = (e->host != NULL);
+  if (dirty_map == NULL) dirty_map = paddr_dirty_map();
+  direct = direct && dirty_map[(e->ppage - CONFIG_MBASE) >> PAGE_SHIFT] == DIRTY_ALL;
+  if (likely(direct)) host_write(e->host + (addr & PAGE_MASK), len, data);
+  else paddr_write(e->ppage | (addr & PAGE_MASK), len, data);
 }
 
 void vaddr_write(vaddr_t addr, int len, word_t data) {
-  paddr_write(addr, len, data);
+  IFDEF(CONFIG_MTRACE, mtrace_access(addr, len, data, MEM_TYPE_WRITE));
+  data_write(addr, len, data);
 }
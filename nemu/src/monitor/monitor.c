@@ -24,7 +24,11 @@ void init_mem();
 void init_difftest(char *ref_so_file, long img_size, int port);
 void init_device();
 void init_sdb();
-void init_disasm();
+bool init_disasm(const char *isa);
+void init_mtrace(const char *file, const char *filters);
+void init_profile(const char *file);
+void init_itrace();
+void init_itrace_file(const char *file);
 
 static void welcome() {
   Log("Trace: %s", MUXDEF(CONFIG_TRACE, ANSI_FMT("ON", ANSI_FG_GREEN), ANSI_FMT("OFF", ANSI_FG_RED)));
@@ -32,27 +36,84 @@ static void welcome() {
         "to record the trace. This may lead to a large log file. "
         "If it is not necessary, you can disable it in menuconfig"));
   Log("Build time: %s, %s", __TIME__, __DATE__);
+  IFNDEF(CONFIG_TARGET_AM, log_flush());
   printf("Welcome to %s-NEMU!\n", ANSI_FMT(str(__GUEST_ISA__), ANSI_FG_YELLOW ANSI_BG_RED));
   printf("For help, type \"help\"\n");
 }
 
 #ifndef CONFIG_TARGET_AM
 #include <getopt.h>
+#include <elf.h>
+
+const void *elf_header();
+const void *elf_program_header();
+int elf_file_fd();
 
 void sdb_set_batch_mode();
+bool sdb_set_fast_forward(char *arg, bool stop);
 
 static char *log_file = NULL;
 static char *elf_file = NULL;
 static char *diff_so_file = NULL;
 static char *img_file = NULL;
+static char *ff_target = NULL;
+static char *mtrace_file = NULL;
+static char *mtrace_filter = NULL;
+static char *profile_file = NULL;
+static char *itrace_file = NULL;
 static int difftest_port = 1234;
 
+static bool is_elf_file(const char *file) {
+  char magic[SELFMAG];
+  FILE *fp = fopen(file, "rb");
+  Assert(fp, "Can not open '%s'", file);
+  bool ret = (fread(magic, SELFMAG, 1, fp) == 1 && memcmp(magic, ELFMAG, SELFMAG) == 0);
+  fclose(fp);
+  return ret;
+}
+
+#define load_segment(bits) do { \
+  const Elf##bits##_Ehdr *eh = elf_header(); \
+  const Elf##bits##_Phdr *ph = elf_program_header(); \
+  for (int i = 0; i < eh->e_phnum; i ++) { \
+    if (ph[i].p_type != PT_LOAD || ph[i].p_memsz == 0) continue; \
+    paddr_t addr = ph[i].p_paddr; \
+    Assert(ph[i].p_filesz <= ph[i].p_memsz, "broken elf file"); \
+    Log("Load segment [" FMT_PADDR ", " FMT_PADDR ")", addr, (paddr_t)(addr + ph[i].p_memsz)); \
+    pmem_load(addr, ph[i].p_filesz, elf_file_fd(), ph[i].p_offset); \
+    pmem_load(addr + ph[i].p_filesz, ph[i].p_memsz - ph[i].p_filesz, -1, 0); \
+    if (addr + ph[i].p_memsz > end) end = addr + ph[i].p_memsz; \
+  } \
+  cpu.pc = eh->e_entry; \
+} while (0)
+
+/* The PT_LOAD segments are loaded to pmem by their physical addresses,
+ * mapped from the file if possible, so that only the pages touched by the
+ * guest are read. The returned size covers all segments from RESET_VECTOR.
+ */
+static long load_elf() {
+  if (elf_file != NULL && strcmp(elf_file, img_file) != 0) {
+    Log("The image is an elf file, ignore '%s'", elf_file);
+  }
+  elf_file = img_file;
+  init_elf(elf_file);
+
+  const unsigned char *ident = elf_header();
+  paddr_t end = RESET_VECTOR;
+  if (ident[EI_CLASS] == ELFCLASS64) load_segment(64);
+  else load_segment(32);
+  Log("The image is %s, entry = " FMT_WORD, img_file, cpu.pc);
+  return end - RESET_VECTOR;
+}
+
 static long load_img() {
   if (img_file == NULL) {
     Log("No image is given. Use the default build-in image.");
     return 4096; // built-in image size
   }
 
+  if (is_elf_file(img_file)) return load_elf();
+
   FILE *fp = fopen(img_file, "rb");
   Assert(fp, "Can not open '%s'", img_file);
 
@@ -61,9 +122,7 @@ static long load_img() {
 
   Log("The image is %s, size = %ld", img_file, size);
 
-  fseek(fp, 0, SEEK_SET);
-  int ret = fread(guest_to_host(RESET_VECTOR), size, 1, fp);
-  assert(ret == 1);
+  pmem_load(RESET_VECTOR, size, fileno(fp), 0);
 
   fclose(fp);
   return size;
@@ -76,25 +135,40 @@ static int parse_args(int argc, char *argv[]) {
     {"elf"      , required_argument, NULL, 'e'},
     {"diff"     , required_argument, NULL, 'd'},
     {"port"     , required_argument, NULL, 'p'},
+    {"ff"       , required_argument, NULL, 'f'},
+    {"mtrace"   , required_argument, NULL, 'm'},
+    {"mtrace-filter", required_argument, NULL, 'M'},
+    {"profile"  , required_argument, NULL, 'P'},
+    {"itrace"   , required_argument, NULL, 'i'},
     {"help"     , no_argument      , NULL, 'h'},
     {0          , 0                , NULL,  0 },
   };
   int o;
-  while ( (o = getopt_long(argc, argv, "-bhl:e:d:p:", table, NULL)) != -1) {
+  while ( (o = getopt_long(argc, argv, "-bhl:e:d:p:f:m:M:P:i:", table, NULL)) != -1) {
     switch (o) {
       case 'b': sdb_set_batch_mode(); break;
       case 'p': sscanf(optarg, "%d", &difftest_port); break;
       case 'l': log_file = optarg; break;
       case 'e': elf_file = optarg; break;
       case 'd': diff_so_file = optarg; break;
+      case 'f': ff_target = optarg; break;
+      case 'm': mtrace_file = optarg; break;
+      case 'M': mtrace_filter = optarg; break;
+      case 'P': profile_file = optarg; break;
+      case 'i': itrace_file = optarg; break;
       case 1: img_file = optarg; return 0;
       default:
         printf("Usage: %s [OPTION...] IMAGE [args]\n\n", argv[0]);
         printf("\t-b,--batch              run with batch mode\n");
         printf("\t-l,--log=FILE           output log to FILE\n");
-        printf("\t-e,--elf=FILE           input elf file\n");
+        printf("\t-e,--elf=FILE           input elf file, implied if IMAGE is an elf file\n");
         printf("\t-d,--diff=REF_SO        run DiffTest with reference REF_SO\n");
         printf("\t-p,--port=PORT          run DiffTest with port PORT\n");
+        printf("\t-f,--ff=N|*ADDR|SYMBOL  run without tracing until the target, then trace\n");
+        printf("\t-m,--mtrace=FILE        write binary records of memory accesses to FILE\n");
+        printf("\t-M,--mtrace-filter=SPEC,...  only trace LOW-HIGH or the device named SPEC\n");
+        printf("\t-P,--profile=FILE       write the folded call stacks traced by ftrace to FILE\n");
+        printf("\t-i,--itrace=FILE        write the itrace and ftrace compressed to FILE instead of the log\n");
         printf("\n");
         exit(0);
     }
@@ -129,7 +203,17 @@ void init_monitor(int argc, char *argv[]) {
   // Log("img_size: %ld\n", img_size);
 
   /* Open the elf file. */
-  IFDEF(CONFIG_ITRACE, init_elf(elf_file));
+  init_elf(elf_file);
+
+  /* Write the itrace to a compressed file. */
+  IFDEF(CONFIG_ITRACE, init_itrace());
+  IFDEF(CONFIG_ITRACE, init_itrace_file(itrace_file));
+
+  /* Profile the guest functions, which needs the symbols. */
+  IFDEF(CONFIG_ITRACE, init_profile(profile_file));
+
+  /* Open the memory trace, after the devices are added. */
+  IFDEF(CONFIG_MTRACE, init_mtrace(mtrace_file, mtrace_filter));
 
   /* Initialize differential testing. */
   init_difftest(diff_so_file, img_size, difftest_port);
@@ -137,7 +221,16 @@ void init_monitor(int argc, char *argv[]) {
   /* Initialize the simple debugger. */
   init_sdb();
 
-  IFDEF(CONFIG_ITRACE, init_disasm());
+  /* Fast-forward to the window to trace. */
+  if (ff_target != NULL) {
+    bool ok = sdb_set_fast_forward(ff_target, false);
+    Assert(ok, "Invalid argument of --ff");
+  }
+
+#ifdef CONFIG_ITRACE
+  bool ok = init_disasm(str(__GUEST_ISA__));
+  Assert(ok, "Can not load the disassembler");
+#endif
 
   /* Display welcome message. */
   welcome();
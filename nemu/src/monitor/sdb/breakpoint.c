@@ -0,0 +1,126 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <isa.h>
+#include <cpu/cpu.h>
+#include "sdb.h"
+
+/* Breakpoints are kept in a hash set indexed by pc, so that checking a pc
+ * costs one bucket lookup. The cpu only checks them when at least one is
+ * set, see cpu_set_break().
+ */
+
+#define NR_BP 32
+#define BP_HASH_SIZE 64
+#define BP_HASH(pc) (((pc) >> 2) & (BP_HASH_SIZE - 1))
+
+typedef struct breakpoint {
+  int NO;
+  vaddr_t pc;
+  char *cond_str;
+  Expr *cond; // NULL if unconditional
+  uint64_t nr_hit;
+  struct breakpoint *next;  // next breakpoint in use or free
+  struct breakpoint *hnext; // next breakpoint in the same hash bucket
+} BP;
+
+static BP bp_pool[NR_BP] = {};
+static BP *head = NULL, *free_ = NULL;
+static BP *bp_hash[BP_HASH_SIZE] = {};
+
+void init_bp_pool() {
+  for (int i = 0; i < NR_BP; i ++) {
+    bp_pool[i].NO = i;
+    bp_pool[i].next = (i == NR_BP - 1 ? NULL : &bp_pool[i + 1]);
+  }
+  head = NULL;
+  free_ = bp_pool;
+}
+
+static BP *bp_lookup(vaddr_t pc) {
+  for (BP *bp = bp_hash[BP_HASH(pc)]; bp != NULL; bp = bp->hnext) {
+    if (bp->pc == pc) return bp;
+  }
+  return NULL;
+}
+
+bool bp_exist(vaddr_t pc) {
+  return bp_lookup(pc) != NULL;
+}
+
+// return true if the execution should stop before the instruction at `pc`
+bool bp_check(vaddr_t pc) {
+  BP *bp = bp_lookup(pc);
+  if (bp == NULL) return false;
+  if (bp->cond != NULL && !expr_eval(bp->cond)) return false;
+  bp->nr_hit ++;
+  printf("\nBreakpoint %d at " FMT_WORD "\n", bp->NO, pc);
+  if (nemu_state.state == NEMU_RUNNING)
+    nemu_state.state = NEMU_STOP;
+  return true;
+}
+
+// return the number of the new breakpoint, or -1 if there is none left
+int new_bp(vaddr_t pc, char *cond_str, Expr *cond) {
+  if (free_ == NULL) return -1;
+  BP *bp = free_;
+  free_ = free_->next;
+  bp->next = head;
+  head = bp;
+
+  bp->pc = pc;
+  bp->cond_str = (cond_str == NULL ? NULL : strdup(cond_str));
+  bp->cond = cond;
+  bp->nr_hit = 0;
+  bp->hnext = bp_hash[BP_HASH(pc)];
+  bp_hash[BP_HASH(pc)] = bp;
+  cpu_set_break(true);
+  return bp->NO;
+}
+
+bool free_bp(int NO) {
+  BP **pp = &head;
+  while (*pp != NULL && (*pp)->NO != NO) pp = &(*pp)->next;
+  BP *bp = *pp;
+  if (bp == NULL) return false;
+  *pp = bp->next;
+
+  BP **hp = &bp_hash[BP_HASH(bp->pc)];
+  while (*hp != bp) hp = &(*hp)->hnext;
+  *hp = bp->hnext;
+
+  free(bp->cond_str);
+  bp->cond_str = NULL;
+  expr_free(bp->cond);
+  bp->cond = NULL;
+
+  bp->next = free_;
+  free_ = bp;
+  cpu_set_break(head != NULL);
+  return true;
+}
+
+void print_bps() {
+  if (head == NULL) {
+    printf("No breakpoints.\n");
+    return;
+  }
+
+  printf("%-10s%-20s%-10s%s\n", "Num", "Address", "Hits", "Condition");
+  for (BP *bp = head; bp != NULL; bp = bp->next) {
+    printf("%-10d" FMT_WORD "%*s%-10" PRIu64 "%s\n", bp->NO, bp->pc,
+        (int)(20 - 2 - sizeof(word_t) * 2), "", bp->nr_hit, bp->cond_str ? bp->cond_str : "");
+  }
+}
@@ -24,6 +24,7 @@
 #include <stdint.h>
 #include <string.h>
 #include <memory/vaddr.h>
+#include "sdb.h"
 
 enum {
   TK_NOTYPE = 256, TK_EQ, TK_AND, TK_NOT_EQ,
@@ -192,10 +193,43 @@ int find_position(int p, int q) {
   return -1;
 }
 
-word_t eval(int p, int q) {
+/* An expression is compiled once into code for a stack machine, in postfix
+ * order of the operators. Registers are resolved to their locations in
+ * `cpu` at compile time, so evaluating the code does no string work. The
+ * code is kept by watchpoints and conditions and evaluated repeatedly.
+ */
+enum {
+  OP_IMM, OP_REG, OP_DEREF, OP_NEG,
+  OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_EQ, OP_NE, OP_AND
+};
+
+typedef struct {
+  int op;
+  union {
+    word_t imm;
+    const word_t *reg;
+  };
+} ExprInst;
+
+struct Expr {
+  int n;
+  ExprInst code[];
+};
+
+static Expr *cur_expr = NULL;
+
+static void emit(int op, word_t imm, const word_t *reg) {
+  ExprInst *i = &cur_expr->code[cur_expr->n ++];
+  i->op = op;
+  if (op == OP_REG) i->reg = reg;
+  else i->imm = imm;
+}
+
+static bool compile(int p, int q) {
   if (p > q) {
     /* Bad expression */
-    panic("Bad expression\n");
+    printf("Bad expression\n");
+    return false;
   }
   else if (p == q) {
     /* Single token.
@@ -203,61 +237,86 @@ word_t eval(int p, int q) {
      * Return the value of the number.
      */
     if (tokens[p].type == TK_DECIMAL)
-      return strtoull(tokens[p].str, NULL, 10);
+      emit(OP_IMM, strtoull(tokens[p].str, NULL, 10), NULL);
     else if (tokens[p].type == TK_HEX)
-      return strtoull(tokens[p].str, NULL, 16);
-    else {
-      // registers
-      bool success;
-      word_t ret = isa_reg_str2val(tokens[p].str + 1, &success);
-
-      if (success) {
-        return ret;
-      } else {
-        panic("register name %s not exists\n", tokens[p].str + 1);
+      emit(OP_IMM, strtoull(tokens[p].str, NULL, 16), NULL);
+    else if (tokens[p].type == TK_REGS) {
+      const word_t *reg = isa_reg_str2ptr(tokens[p].str + 1);
+      if (reg == NULL) {
+        printf("register name %s not exists\n", tokens[p].str + 1);
+        return false;
       }
+      emit(OP_REG, 0, reg);
+    } else {
+      printf("Bad expression\n");
+      return false;
     }
+    return true;
   }
   else if (check_parentheses(p, q) == true) {
     /* The expression is surrounded by a matched pair of parentheses.
      * If that is the case, just throw away the parentheses.
      */
-    return eval(p + 1, q - 1);
+    return compile(p + 1, q - 1);
   }
   else {
-    /* We should do more things here. */
-    // Assert(tokens[p].type == TK_DECIMAL && tokens[q].type == TK_DECIMAL, "p and q should all be decimal ints!");
-    // 4 +3*(2- 1)
-    if (tokens[p].type == TK_DEREF) {
-      word_t val2 = eval(p + 1, q);
-      return vaddr_read(val2, sizeof(word_t));
-    } else if (tokens[p].type == TK_UNARY_MINUS) {
-      word_t val2 = eval(p + 1, q);
-      return -((sword_t)val2);
+    if (tokens[p].type == TK_DEREF || tokens[p].type == TK_UNARY_MINUS) {
+      if (!compile(p + 1, q)) return false;
+      emit(tokens[p].type == TK_DEREF ? OP_DEREF : OP_NEG, 0, NULL);
+      return true;
     }
     int op = find_position(p, q);
-    Assert(op > p, "no op between p and q");
+    if (op <= p) {
+      printf("no op between p and q\n");
+      return false;
+    }
 
-    word_t val1 = eval(p, op - 1);
-    word_t val2 = eval(op + 1, q);
+    if (!compile(p, op - 1) || !compile(op + 1, q)) return false;
     switch (tokens[op].type) {
-      case '+': return val1 + val2;
-      case '-': return val1 - val2;
-      case '*': return val1 * val2;
-      case '/': Assert(val2 != 0, "divide by zero!"); return val1 / val2;
-      case TK_EQ: return val1 == val2;
-      case TK_NOT_EQ: return val1 != val2;
-      case TK_AND: return val1 && val2;
+      case '+': emit(OP_ADD, 0, NULL); break;
+      case '-': emit(OP_SUB, 0, NULL); break;
+      case '*': emit(OP_MUL, 0, NULL); break;
+      case '/': emit(OP_DIV, 0, NULL); break;
+      case TK_EQ: emit(OP_EQ, 0, NULL); break;
+      case TK_NOT_EQ: emit(OP_NE, 0, NULL); break;
+      case TK_AND: emit(OP_AND, 0, NULL); break;
       default: Assert(0, "invalid op");
     }
+    return true;
   }
 }
 
+word_t expr_eval(const Expr *e) {
+  word_t stack[e->n];
+  int sp = 0;
+  for (const ExprInst *i = e->code; i < e->code + e->n; i ++) {
+    word_t val2;
+    switch (i->op) {
+      case OP_IMM: stack[sp ++] = i->imm; continue;
+      case OP_REG: stack[sp ++] = *i->reg; continue;
+      case OP_DEREF: stack[sp - 1] = vaddr_read(stack[sp - 1], sizeof(word_t)); continue;
+      case OP_NEG: stack[sp - 1] = -((sword_t)stack[sp - 1]); continue;
+    }
+    val2 = stack[-- sp];
+    word_t *val1 = &stack[sp - 1];
+    switch (i->op) {
+      case OP_ADD: *val1 = *val1 + val2; break;
+      case OP_SUB: *val1 = *val1 - val2; break;
+      case OP_MUL: *val1 = *val1 * val2; break;
+      case OP_DIV: Assert(val2 != 0, "divide by zero!"); *val1 = *val1 / val2; break;
+      case OP_EQ: *val1 = *val1 == val2; break;
+      case OP_NE: *val1 = *val1 != val2; break;
+      case OP_AND: *val1 = *val1 && val2; break;
+    }
+  }
+  return stack[0];
+}
 
-word_t expr(char *e, bool *success) {
-  if (!make_token(e)) {
-    *success = false;
-    return 0;
+Expr *expr_compile(char *e) {
+  if (!make_token(e)) return NULL;
+  if (nr_token == 0) {
+    printf("Bad expression\n");
+    return NULL;
   }
 
   for (int i = 0; i < nr_token; i ++) {
@@ -269,6 +328,27 @@ word_t expr(char *e, bool *success) {
       tokens[i].type = TK_UNARY_MINUS;
     }
   }
-  *success = true;
-  return eval(0, nr_token - 1);
+
+  // each token emits at most one instruction
+  cur_expr = malloc(sizeof(Expr) + sizeof(ExprInst) * nr_token);
+  assert(cur_expr);
+  cur_expr->n = 0;
+  if (!compile(0, nr_token - 1)) {
+    free(cur_expr);
+    return NULL;
+  }
+  return cur_expr;
+}
+
+void expr_free(Expr *e) {
+  free(e);
+}
+
+word_t expr(char *e, bool *success) {
+  Expr *code = expr_compile(e);
+  *success = (code != NULL);
+  if (code == NULL) return 0;
+  word_t ret = expr_eval(code);
+  expr_free(code);
+  return ret;
 }
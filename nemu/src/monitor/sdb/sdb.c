@@ -28,11 +28,17 @@ static int is_batch_mode = false;
 
 void init_regex();
 void init_wp_pool();
+void init_bp_pool();
 
 void print_wps();
 WP* new_wp();
+WP* new_addr_wp(paddr_t addr, word_t len);
 void free_wp(WP *wp, WP* parent);
+void cpu_set_itrace_cond(Expr *cond);
 WP* find_wp_with_index(int NO, WP** parent);
+void print_bps();
+int new_bp(vaddr_t pc, char *cond_str, Expr *cond);
+bool free_bp(int NO);
 
 /* We use the `readline' library to provide more flexibility to read from stdin. */
 static char* rl_gets() {
@@ -43,6 +49,8 @@ static char* rl_gets() {
     line_read = NULL;
   }
 
+  // show the lines logged so far before the prompt
+  log_flush();
   line_read = readline("(nemu) ");
 
   if (line_read && *line_read) {
@@ -91,6 +99,8 @@ static int cmd_info(char *args) {
     isa_reg_display();
   else if (strcmp(token, "w") == 0) {
     print_wps();
+  } else if (strcmp(token, "b") == 0) {
+    print_bps();
   } else {
     panic("Unknown command argument '%s'\n", token);
   }
@@ -168,16 +178,21 @@ static int cmd_p(char *args) {
 static int cmd_w(char* args) {
   Assert(args != NULL, "watch command must have expression as argument");
 
+  // compile the expression once, it is evaluated after every instruction
+  Expr *code = expr_compile(args);
+  if (code == NULL) {
+    printf("expression evaluation failed!\n");
+    return 0;
+  }
+
   WP* nW = new_wp();
 
   nW->expr = (char*)malloc(sizeof(char) * (strlen(args) + 1));
 
   strcpy(nW->expr, args);
 
-  bool success;
-  nW->last_value = expr(nW->expr, &success);
-
-  Assert(success == true, "give watchpoint initial value failed");
+  nW->code = code;
+  nW->last_value = expr_eval(code);
 
   #ifdef CONFIG_ISA64
   printf("watchpoint %d: %s, initial value: %lu\n", nW->NO, nW->expr, nW->last_value);
@@ -188,6 +203,41 @@ static int cmd_w(char* args) {
   return 0;
 }
 
+// wa EXPR[, LEN]: watch LEN bytes of pmem from the physical address EXPR
+static int cmd_wa(char* args) {
+  if (args == NULL) {
+    printf("Usage: wa EXPR[, LEN]\n");
+    return 0;
+  }
+
+  word_t len = sizeof(word_t);
+  char *comma = strrchr(args, ',');
+  if (comma != NULL) {
+    char *endptr;
+    *comma = '\0';
+    len = strtoul(comma + 1, &endptr, 0);
+    if (endptr == comma + 1 || strspn(endptr, " ") != strlen(endptr)) {
+      printf("Invalid length '%s'\n", comma + 1);
+      return 0;
+    }
+  }
+
+  bool success;
+  paddr_t addr = expr(args, &success);
+  if (!success) {
+    printf("expression evaluation failed!\n");
+    return 0;
+  }
+
+  WP* nW = new_addr_wp(addr, len);
+  if (nW == NULL) {
+    printf("[" FMT_PADDR ", +" FMT_WORD ") is not in pmem\n", addr, len);
+    return 0;
+  }
+  printf("watchpoint %d: %s\n", nW->NO, nW->expr);
+  return 0;
+}
+
 static int cmd_d(char* args) {
   Assert(args != NULL, "delete command must have a number as argument");
 
@@ -215,6 +265,145 @@ static int cmd_d(char* args) {
   return 0;
 }
 
+bool elf_find_func(const char *name, vaddr_t *addr);
+
+/* The target of fast-forwarding is one of
+ *   N       the N-th instruction since NEMU started
+ *   *EXPR   the address EXPR evaluates to
+ *   SYMBOL  the entry of function SYMBOL, which needs an elf file
+ */
+static bool parse_ff_target(char *arg, uint64_t *nr_inst, vaddr_t *pc) {
+  *nr_inst = 0;
+  *pc = (vaddr_t)-1;
+  if (arg == NULL) return false;
+  while (*arg == ' ') arg ++;
+
+  if (*arg == '*') {
+    bool success;
+    *pc = expr(arg + 1, &success);
+    return success;
+  }
+
+  char *endptr;
+  uint64_t n = strtoull(arg, &endptr, 0);
+  if (endptr != arg && *endptr == '\0') {
+    extern uint64_t g_nr_guest_inst;
+    *nr_inst = n;
+    return n > g_nr_guest_inst;
+  }
+
+  return elf_find_func(arg, pc);
+}
+
+bool sdb_set_fast_forward(char *arg, bool stop) {
+  uint64_t nr_inst;
+  vaddr_t pc;
+  if (!parse_ff_target(arg, &nr_inst, &pc)) {
+    printf("Invalid fast-forward target '%s'\n", arg ? arg : "");
+    return false;
+  }
+  cpu_fast_forward(nr_inst, pc, stop);
+  return true;
+}
+
+// b ADDR|SYMBOL|*EXPR [if COND]: stop before executing the instruction there
+static int cmd_b(char *args) {
+  if (args == NULL) {
+    printf("Usage: b ADDR|SYMBOL|*EXPR [if COND]\n");
+    return 0;
+  }
+
+  char *cond_str = strstr(args, " if ");
+  if (cond_str != NULL) {
+    *cond_str = '\0';
+    cond_str += 4;
+  }
+
+  char *target = strtok(args, " ");
+  vaddr_t pc;
+  bool success = (target != NULL);
+  if (success && *target == '*') {
+    pc = expr(target + 1, &success);
+  } else if (success) {
+    char *endptr;
+    pc = strtoull(target, &endptr, 0);
+    if (*endptr != '\0') success = elf_find_func(target, &pc);
+  }
+  if (!success) {
+    printf("Invalid breakpoint address '%s'\n", target ? target : "");
+    return 0;
+  }
+
+  Expr *cond = NULL;
+  if (cond_str != NULL && (cond = expr_compile(cond_str)) == NULL) {
+    printf("expression evaluation failed!\n");
+    return 0;
+  }
+
+  int NO = new_bp(pc, cond_str, cond);
+  if (NO < 0) {
+    printf("Too many breakpoints\n");
+    expr_free(cond);
+    return 0;
+  }
+  printf("Breakpoint %d at " FMT_WORD "\n", NO, pc);
+  return 0;
+}
+
+static int cmd_bd(char *args) {
+  char *token = strtok(args, " ");
+  char *endptr;
+  int NO = (token == NULL ? -1 : strtol(token, &endptr, 10));
+  if (token == NULL || *endptr != '\0') {
+    printf("Usage: bd N\n");
+  } else if (!free_bp(NO)) {
+    printf("No breakpoint number %d.\n", NO);
+  }
+  return 0;
+}
+
+static int cmd_ff(char *args) {
+  if (sdb_set_fast_forward(args, true)) {
+    cpu_exec(-1);
+  }
+  return 0;
+}
+
+static int cmd_trace(char *args) {
+  char *token = strtok(args, " ");
+  if (token != NULL && strcmp(token, "if") == 0) {
+    // trace if [EXPR]: only log the instructions when EXPR is non-zero
+    char *cond = strtok(NULL, "");
+    Expr *code = NULL;
+    if (cond != NULL && (code = expr_compile(cond)) == NULL) {
+      printf("expression evaluation failed!\n");
+      return 0;
+    }
+    cpu_set_itrace_cond(code);
+  } else if (token != NULL && strcmp(token, "on") == 0) {
+    cpu_set_trace(true);
+  } else if (token != NULL && strcmp(token, "off") == 0) {
+    cpu_set_trace(false);
+  } else {
+    printf("Usage: trace on|off|if [EXPR]\n");
+  }
+  return 0;
+}
+
+#ifdef CONFIG_MTRACE
+static int cmd_mtrace(char *args) {
+  char *token = strtok(args, " ");
+  if (token == NULL) {
+    mtrace_display_filter();
+  } else if (strcmp(token, "clear") == 0) {
+    mtrace_clear_filter();
+  } else if (!mtrace_add_filter(token)) {
+    printf("Usage: mtrace [LOW-HIGH|DEVICE|clear]\n");
+  }
+  return 0;
+}
+#endif
+
 static int cmd_help(char *args);
 
 static struct {
@@ -232,7 +421,15 @@ static struct {
   { "x", "Scan Memory", cmd_x},
   { "p", "Expression Evaluation", cmd_p},
   { "w", "Setting Watchpoints", cmd_w},
+  { "wa", "Watch the stores to LEN bytes at a physical address", cmd_wa},
   { "d", "Delete Watchpoint", cmd_d},
+  { "b", "Set a breakpoint at ADDR, SYMBOL or *EXPR, optionally with 'if COND'", cmd_b},
+  { "bd", "Delete Breakpoint", cmd_bd},
+  { "ff", "Run without tracing until instruction N, *ADDR or SYMBOL, then trace", cmd_ff},
+  { "trace", "Turn tracing, difftest and watchpoints on or off", cmd_trace},
+#ifdef CONFIG_MTRACE
+  { "mtrace", "List, add or clear the filters of the memory tracer", cmd_mtrace},
+#endif
 };
 
 #define NR_CMD ARRLEN(cmd_table)
@@ -308,4 +505,7 @@ void init_sdb() {
 
   /* Initialize the watchpoint pool. */
   init_wp_pool();
+
+  /* Initialize the breakpoint pool. */
+  init_bp_pool();
 }
@@ -18,13 +18,21 @@
 
 #include <common.h>
 
+// an expression compiled by expr_compile()
+typedef struct Expr Expr;
+
 typedef struct watchpoint {
   int NO;
   struct watchpoint *next;
 
   /* TODO: Add more members if necessary */
   char* expr;
+  Expr* code;
   word_t last_value;
+
+  // an address watchpoint is hit by the stores overlapping [low, high] of pmem
+  bool is_addr;
+  paddr_t low, high;
 } WP;
 
 typedef struct changed_watchpoint {
@@ -33,5 +41,9 @@ typedef struct changed_watchpoint {
 } CWP;
 
 word_t expr(char *e, bool *success);
+// return NULL if `e` is invalid
+Expr *expr_compile(char *e);
+word_t expr_eval(const Expr *e);
+void expr_free(Expr *e);
 
 #endif
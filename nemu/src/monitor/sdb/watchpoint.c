@@ -13,24 +13,69 @@
 * See the Mulan PSL v2 for more details.
 ***************************************************************************************/
 
+#include <isa.h>
 #include "sdb.h"
+#include <memory/host.h>
+#include <memory/paddr.h>
+#include <memory/vaddr.h>
 
 #define NR_WP 32
 
 static WP wp_pool[NR_WP] = {};
 static WP *head = NULL, *free_ = NULL;
 
+static void watch_store(paddr_t addr, int len, word_t data);
+
 void init_wp_pool() {
   int i;
   for (i = 0; i < NR_WP; i ++) {
     wp_pool[i].NO = i;
     wp_pool[i].next = (i == NR_WP - 1 ? NULL : &wp_pool[i + 1]);
     wp_pool[i].expr = NULL;
+    wp_pool[i].code = NULL;
     wp_pool[i].last_value = 0;
+    wp_pool[i].is_addr = false;
   }
 
   head = NULL;
   free_ = wp_pool;
+  paddr_set_watch_handler(watch_store);
+}
+
+/* Address watchpoints do not evaluate anything per instruction. Their pages
+ * are watched by the memory, which passes every store to them to
+ * watch_store(), so only the stores to these pages are checked.
+ */
+static void watch_store(paddr_t addr, int len, word_t data) {
+  for (WP* cur = head; cur != NULL; cur = cur->next) {
+    if (!cur->is_addr || addr > cur->high || addr + len - 1 < cur->low) continue;
+    word_t old = host_read(guest_to_host(addr), len);
+    word_t new = (len == sizeof(word_t) ? data : data & (((word_t)1 << (len * 8)) - 1));
+    printf("\nwatchpoint %d: %s\n\n", cur->NO, cur->expr);
+    // the threaded engine only updates the pc at the end of a block
+    printf("Store %d byte(s) at " FMT_PADDR, len, addr);
+    IFNDEF(CONFIG_ENGINE_THREADED, printf(", pc = " FMT_WORD, cpu.pc));
+    printf("\nOld value = " FMT_WORD "\n", old);
+    printf("New value = " FMT_WORD "\n", new);
+    if (nemu_state.state == NEMU_RUNNING)
+      nemu_state.state = NEMU_STOP;
+    IFDEF(CONFIG_ENGINE_THREADED, isa_exec_block_stop());
+  }
+}
+
+// a page may be shared by several address watchpoints
+static void update_watched_pages(WP *removed) {
+  if (removed != NULL) {
+    for (paddr_t p = removed->low & ~PAGE_MASK; p <= removed->high; p += PAGE_SIZE) {
+      paddr_watch_page(p, false);
+    }
+  }
+  for (WP* cur = head; cur != NULL; cur = cur->next) {
+    if (!cur->is_addr) continue;
+    for (paddr_t p = cur->low & ~PAGE_MASK; p <= cur->high; p += PAGE_SIZE) {
+      paddr_watch_page(p, true);
+    }
+  }
 }
 
 /* TODO: Implement the functionality of watchpoint */
@@ -49,6 +94,18 @@ WP* new_wp() {
   return p;
 }
 
+WP* new_addr_wp(paddr_t addr, word_t len) {
+  if (len == 0 || !in_pmem(addr) || len - 1 > PMEM_RIGHT - addr) return NULL;
+  WP *p = new_wp();
+  p->is_addr = true;
+  p->low = addr;
+  p->high = addr + len - 1;
+  p->expr = malloc(64);
+  snprintf(p->expr, 64, "[" FMT_PADDR ", " FMT_PADDR "]", p->low, p->high);
+  update_watched_pages(NULL);
+  return p;
+}
+
 void free_wp(WP *wp, WP* parent) {
   if (parent == NULL) {
     head = wp->next;
@@ -56,8 +113,14 @@ void free_wp(WP *wp, WP* parent) {
     parent->next = wp->next;
   }
 
+  if (wp->is_addr) {
+    wp->is_addr = false;
+    update_watched_pages(wp);
+  }
   free(wp->expr);
   wp->expr = NULL;
+  expr_free(wp->code);
+  wp->code = NULL;
   wp->last_value = 0;
 
   wp->next = free_;
@@ -90,10 +153,8 @@ uint8_t detect_wp_change(CWP** vec_wp) {
   uint8_t size = 0;
 
   for (WP* cur = head; cur != NULL; cur = cur->next) {
-    bool success;
-    word_t ret = expr(cur->expr, &success);
-
-    Assert(success == true, "expression evaluation failed");
+    if (cur->is_addr) continue;
+    word_t ret = expr_eval(cur->code);
 
     if (ret != cur->last_value) {
       *vec_wp = (CWP*)realloc(*(vec_wp), (++size) * sizeof(CWP));
@@ -14,8 +14,19 @@
 ***************************************************************************************/
 
 #include <dlfcn.h>
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <capstone/capstone.h>
-#include <common.h>
+
+/* The guest ISA is given by its name, so that the disassembler does not
+ * depend on the configuration, and is shared with tools/itrace-dump.
+ * Capstone is loaded from $NEMU_HOME if it is set.
+ */
+
+#define LIBCAPSTONE "tools/capstone/repo/libcapstone.so.5"
 
 static size_t (*cs_disasm_dl)(csh handle, const uint8_t *code,
     size_t code_size, uint64_t address, size_t count, cs_insn **insn);
@@ -23,10 +34,30 @@ static void (*cs_free_dl)(cs_insn *insn, size_t count);
 
 static csh handle;
 
-void init_disasm() {
+static const struct {
+  const char *isa;
+  cs_arch arch;
+  cs_mode mode;
+} isa_table[] = {
+  { "x86",          CS_ARCH_X86,       CS_MODE_32 },
+  { "mips32",       CS_ARCH_MIPS,      CS_MODE_MIPS32 },
+  { "riscv32",      CS_ARCH_RISCV,     CS_MODE_RISCV32 | CS_MODE_RISCVC },
+  { "riscv64",      CS_ARCH_RISCV,     CS_MODE_RISCV64 | CS_MODE_RISCVC },
+  { "loongarch32r", CS_ARCH_LOONGARCH, CS_MODE_LOONGARCH32 },
+};
+
+// return false if the ISA is unknown or capstone can not be loaded
+bool init_disasm(const char *isa) {
+  int i, n = sizeof(isa_table) / sizeof(isa_table[0]);
+  for (i = 0; i < n && strcmp(isa_table[i].isa, isa) != 0; i ++);
+  if (i == n) return false;
+
+  char path[4096];
+  const char *home = getenv("NEMU_HOME");
+  snprintf(path, sizeof(path), "%s%s%s", home ? home : "", home ? "/" : "", LIBCAPSTONE);
   void *dl_handle;
-  dl_handle = dlopen("tools/capstone/repo/libcapstone.so.5", RTLD_LAZY);
-  assert(dl_handle);
+  dl_handle = dlopen(path, RTLD_LAZY);
+  if (dl_handle == NULL) return false;
 
   cs_err (*cs_open_dl)(cs_arch arch, cs_mode mode, csh *handle) = NULL;
   cs_open_dl = dlsym(dl_handle, "cs_open");
@@ -38,31 +69,27 @@ void init_disasm() {
   cs_free_dl = dlsym(dl_handle, "cs_free");
   assert(cs_free_dl);
 
-  cs_arch arch = MUXDEF(CONFIG_ISA_x86,      CS_ARCH_X86,
-                   MUXDEF(CONFIG_ISA_mips32, CS_ARCH_MIPS,
-                   MUXDEF(CONFIG_ISA_riscv,  CS_ARCH_RISCV,
-                   MUXDEF(CONFIG_ISA_loongarch32r,  CS_ARCH_LOONGARCH, -1))));
-  cs_mode mode = MUXDEF(CONFIG_ISA_x86,      CS_MODE_32,
-                   MUXDEF(CONFIG_ISA_mips32, CS_MODE_MIPS32,
-                   MUXDEF(CONFIG_ISA_riscv,  MUXDEF(CONFIG_ISA64, CS_MODE_RISCV64, CS_MODE_RISCV32) | CS_MODE_RISCVC,
-                   MUXDEF(CONFIG_ISA_loongarch32r,  CS_MODE_LOONGARCH32, -1))));
-	int ret = cs_open_dl(arch, mode, &handle);
+  int ret = cs_open_dl(isa_table[i].arch, isa_table[i].mode, &handle);
   assert(ret == CS_ERR_OK);
 
-#ifdef CONFIG_ISA_x86
-  cs_err (*cs_option_dl)(csh handle, cs_opt_type type, size_t value) = NULL;
-  cs_option_dl = dlsym(dl_handle, "cs_option");
-  assert(cs_option_dl);
+  if (isa_table[i].arch == CS_ARCH_X86) {
+    cs_err (*cs_option_dl)(csh handle, cs_opt_type type, size_t value) = NULL;
+    cs_option_dl = dlsym(dl_handle, "cs_option");
+    assert(cs_option_dl);
 
-  ret = cs_option_dl(handle, CS_OPT_SYNTAX, CS_OPT_SYNTAX_ATT);
-  assert(ret == CS_ERR_OK);
-#endif
+    ret = cs_option_dl(handle, CS_OPT_SYNTAX, CS_OPT_SYNTAX_ATT);
+    assert(ret == CS_ERR_OK);
+  }
+  return true;
 }
 
 void disassemble(char *str, int size, uint64_t pc, uint8_t *code, int nbyte) {
 	cs_insn *insn;
 	size_t count = cs_disasm_dl(handle, code, nbyte, pc, 0, &insn);
-  assert(count == 1);
+  if (count == 0) {
+    snprintf(str, size, "(bad)");
+    return;
+  }
   int ret = snprintf(str, size, "%s", insn->mnemonic);
   if (insn->op_str[0] != '\0') {
     snprintf(str + ret, size - ret, "\t%s", insn->op_str);
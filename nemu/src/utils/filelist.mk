@@ -22,3 +22,14 @@ src/utils/disasm.c: $(LIBCAPSTONE)
 $(LIBCAPSTONE):
 	$(MAKE) -C tools/capstone
 endif
+
+# the log, itrace and mtrace are written by threads
+LIBS += -lpthread
+
+ifndef CONFIG_ITRACE
+SRCS-BLACKLIST-y += src/utils/itrace.c src/utils/itrace-file.c src/utils/lz.c
+endif
+
+ifndef CONFIG_MTRACE
+SRCS-BLACKLIST-y += src/utils/mtrace.c
+endif
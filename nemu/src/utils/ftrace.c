@@ -1,13 +1,33 @@
 #include <common.h>
+#include <isa.h>
 #include <elf.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #ifndef CONFIG_TARGET_AM
-static FILE *elf_fp = NULL;
-static char *str_tbl = NULL;
-static Elf32_Sym *sym_tbl = NULL;
-static uint32_t symbol_count = 0;
+/* The ELF file is mapped read-only and parsed in place. It is parsed once
+ * and shared with the loader in monitor.c, which maps the segments from
+ * `elf_fd` when the image itself is an ELF file.
+ */
+static int elf_fd = -1;
+static uint8_t *elf_image = NULL;
+static size_t elf_size = 0;
+
+/* The STT_FUNC symbols are copied into `func_tbl` when the ELF file is
+ * parsed. The functions with a size come first and are sorted by address,
+ * so that the function containing an address is found by binary search.
+ * Functions without a size are only looked up by name.
+ */
+typedef struct {
+  vaddr_t start, end;
+  const char *name;
+} FuncSym;
+
+static FuncSym *func_tbl = NULL;
+static int nr_func = 0, nr_func_range = 0;
 
 static bool iself(Elf32_Ehdr *eh) {
   /* ELF magic bytes are 0x7f,'E','L','F'
@@ -25,95 +45,143 @@ static bool iself(Elf32_Ehdr *eh) {
   }
 }
 
-static void read_section_header(int32_t fd, Elf32_Ehdr *eh,
-                                Elf32_Shdr *sh_table) {
-  uint32_t i;
-
-  assert(lseek(fd, (off_t)eh->e_shoff, SEEK_SET) == (off_t)eh->e_shoff);
-
-  for (i = 0; i < eh->e_shnum; i++) {
-    assert(read(fd, (void *)&sh_table[i], eh->e_shentsize) == eh->e_shentsize);
-  }
+// the pointer to [off, off + size) of the file, which must be inside the file
+static void *elf_at(uint64_t off, uint64_t size) {
+  Assert(off <= elf_size && size <= elf_size - off, "broken elf file");
+  return elf_image + off;
 }
 
-static void read_elf_header(int32_t fd, Elf32_Ehdr *eh) {
-  Assert(lseek(fd, (off_t)0, SEEK_SET) == (off_t)0, "lseek");
-  Assert(read(fd, (void *)eh, sizeof(Elf32_Ehdr)) == sizeof(Elf32_Ehdr),
-         "read elf header");
+static int func_cmp(const void *a, const void *b) {
+  const FuncSym *fa = a, *fb = b;
+  bool ra = fa->end > fa->start, rb = fb->end > fb->start;
+  if (ra != rb) return rb - ra;
+  return (fa->start > fb->start) - (fa->start < fb->start);
 }
 
-static char *read_section32(int32_t fd, Elf32_Shdr *sh) {
-  char *buff = malloc(sh->sh_size);
+#define read_symbol(bits) do { \
+  const Elf##bits##_Shdr *sh = elf_at(elf_header->e_shoff, \
+      (uint64_t)elf_header->e_shnum * sizeof(*sh)); \
+  for (int i = 0; i < elf_header->e_shnum; i ++) { \
+    if (sh[i].sh_type != SHT_SYMTAB) continue; \
+    const Elf##bits##_Sym *sym = elf_at(sh[i].sh_offset, sh[i].sh_size); \
+    /* Read linked string-table \
+     * Section containing the string table having names of \
+     * symbols of this section \
+     */ \
+    const Elf##bits##_Shdr *strh = &sh[sh[i].sh_link]; \
+    const char *str_tbl = elf_at(strh->sh_offset, strh->sh_size); \
+    int n = sh[i].sh_size / sizeof(*sym); \
+    func_tbl = realloc(func_tbl, sizeof(FuncSym) * (nr_func + n)); \
+    assert(func_tbl); \
+    for (int j = 0; j < n; j ++) { \
+      if (ELF##bits##_ST_TYPE(sym[j].st_info) != STT_FUNC) continue; \
+      Assert(sym[j].st_name < strh->sh_size, "broken elf file"); \
+      FuncSym *f = &func_tbl[nr_func ++]; \
+      f->start = sym[j].st_value; \
+      f->end = sym[j].st_value + sym[j].st_size; \
+      f->name = str_tbl + sym[j].st_name; \
+      if (f->end > f->start) nr_func_range ++; \
+    } \
+  } \
+} while (0)
 
-  assert(buff != NULL);
-  assert(lseek(fd, (off_t)sh->sh_offset, SEEK_SET) == (off_t)sh->sh_offset);
-  assert(read(fd, (void *)buff, sh->sh_size) == sh->sh_size);
+void init_elf(const char *elf_file) {
+  if (elf_file == NULL) {
+    Log("No elf file is given. Function symbols are not available.");
+    return;
+  }
+  if (elf_image != NULL) return; // already parsed as the image
+
+  elf_fd = open(elf_file, O_RDONLY);
+  Assert(elf_fd >= 0, "Can not open '%s'", elf_file);
+  struct stat st;
+  Assert(fstat(elf_fd, &st) == 0, "fstat");
+  elf_size = st.st_size;
+  Assert(elf_size >= sizeof(Elf32_Ehdr), "not an elf file!");
+  elf_image = mmap(NULL, elf_size, PROT_READ, MAP_PRIVATE, elf_fd, 0);
+  Assert(elf_image != MAP_FAILED, "Can not map '%s'", elf_file);
+
+  Assert(iself((Elf32_Ehdr *)elf_image), "not an elf file!");
+  if (elf_image[EI_CLASS] == ELFCLASS64) {
+    Assert(elf_size >= sizeof(Elf64_Ehdr), "not an elf file!");
+    const Elf64_Ehdr *elf_header = (Elf64_Ehdr *)elf_image;
+    read_symbol(64);
+  } else {
+    Assert(elf_image[EI_CLASS] == ELFCLASS32, "unknown elf class");
+    const Elf32_Ehdr *elf_header = (Elf32_Ehdr *)elf_image;
+    read_symbol(32);
+  }
+  qsort(func_tbl, nr_func, sizeof(FuncSym), func_cmp);
 
-  return buff;
+  Log("elf is scuessfully parsed! %d function symbols", nr_func);
 }
 
-static void read_symbol(int32_t fd, Elf32_Ehdr *eh, Elf32_Shdr *sh,
-                         uint32_t symbol_table) {
-  //   uint32_t i, symbol_count;
-
-  sym_tbl = (Elf32_Sym *)read_section32(fd, &sh[symbol_table]);
-
-  /* Read linked string-table
-   * Section containing the string table having names of
-   * symbols of this section
-   */
-  uint32_t str_tbl_ndx = sh[symbol_table].sh_link;
-  str_tbl = read_section32(fd, &sh[str_tbl_ndx]);
-
-  symbol_count = (sh[symbol_table].sh_size / sizeof(Elf32_Sym));
-
-  //   for (i = 0; i < symbol_count; i++) {
-  //     printf("0x%08x ", sym_tbl[i].st_value);
-  //     printf("0x%02x ", ELF32_ST_BIND(sym_tbl[i].st_info));
-  //     printf("0x%02x ", ELF32_ST_TYPE(sym_tbl[i].st_info));
-  //     printf("0x%02x ", sym_tbl[i].st_size);
-  //     printf("%s\n", (str_tbl + sym_tbl[i].st_name));
-  //   }
-
-  return;
+/* The header of the ELF file given to init_elf(), NULL if there is none.
+ * It is an Elf32_Ehdr or an Elf64_Ehdr according to e_ident[EI_CLASS].
+ */
+const void *elf_header() {
+  return elf_image;
 }
 
-void init_elf(const char *elf_file) {
-  elf_fp = stdout;
-  if (elf_file != NULL) {
-    FILE *fp = fopen(elf_file, "r");
-    Assert(fp, "Can not open '%s'", elf_file);
-    elf_fp = fp;
+// the program headers of the same class, which are checked to be inside the file
+const void *elf_program_header() {
+  if (elf_image[EI_CLASS] == ELFCLASS64) {
+    const Elf64_Ehdr *eh = elf_header();
+    return elf_at(eh->e_phoff, (uint64_t)eh->e_phnum * sizeof(Elf64_Phdr));
   }
+  const Elf32_Ehdr *eh = elf_header();
+  return elf_at(eh->e_phoff, (uint64_t)eh->e_phnum * sizeof(Elf32_Phdr));
+}
 
-  int32_t fd = fileno(elf_fp);
-
-  Elf32_Ehdr *elf_header = (Elf32_Ehdr *)malloc(sizeof(Elf32_Ehdr));
-
-  read_elf_header(fd, elf_header);
-
-  if (!iself(elf_header)) {
-    free(elf_header);
-    Assert(0, "not an elf file!");
-  }
+int elf_file_fd() {
+  return elf_fd;
+}
 
-  Elf32_Shdr *sec_header =
-      (Elf32_Shdr *)malloc(elf_header->e_shentsize * elf_header->e_shnum);
+// the functions are indexed in the order of their addresses
+int elf_nr_func() {
+  return nr_func;
+}
 
-  read_section_header(fd, elf_header, sec_header);
+const char *elf_func_name(int i) {
+  return func_tbl[i].name;
+}
 
-  for (int i = 0; i < elf_header->e_shnum; i++) {
-    if (sec_header[i].sh_type == SHT_SYMTAB) {
-      read_symbol(fd, elf_header, sec_header, i);
+// look up the address of the function `name'
+bool elf_find_func(const char *name, vaddr_t *addr) {
+  for (int i = 0; i < nr_func; i++) {
+    if (strcmp(func_tbl[i].name, name) == 0) {
+      *addr = func_tbl[i].start;
+      return true;
     }
   }
+  return false;
+}
 
-  Log("elf is scuessfully parsed!");
+/* Find the function containing `addr`. If there is none, NULL is returned
+ * and [*lo, *hi) is set to the gap between functions containing `addr`.
+ */
+static const FuncSym *func_lookup(vaddr_t addr, vaddr_t *lo, vaddr_t *hi) {
+  int l = 0, r = nr_func_range;
+  // find the last function starting at or below addr
+  while (l < r) {
+    int m = (l + r) / 2;
+    if (func_tbl[m].start <= addr) l = m + 1;
+    else r = m;
+  }
+  const FuncSym *f = (l > 0 ? &func_tbl[l - 1] : NULL);
+  if (f != NULL && addr < f->end) {
+    *lo = f->start;
+    *hi = f->end;
+    return f;
+  }
+  *lo = (f != NULL ? f->end : 0);
+  *hi = (l < nr_func_range ? func_tbl[l].start : (vaddr_t)-1);
+  return NULL;
 }
 
 static int indent_cnt = 0;
 
-#define INDENT printf("  ");
+#define INDENT log_stdout("  ");
 #define PRINT_INDENT(cnt)           \
   do {                              \
     for (int i = 0; i < cnt; i++) { \
@@ -127,39 +195,198 @@ static int indent_cnt = 0;
 #define FTRACE_Log(format, ...) \
     _Log(ANSI_FMT(format, ANSI_FG_BLUE) , ## __VA_ARGS__)
 
-int find_stat(vaddr_t pc, vaddr_t snpc) {
-  int pcfid = -1, snpcfid = -1;
-  bool snpc_begin = false;
+/* With --profile, the call stack is shadowed by a call tree, whose nodes
+ * count the instructions retired with exactly that stack. At exit, the
+ * stacks are written in the folded format of flamegraph.pl and speedscope,
+ * and a flat profile of the functions is printed. The counts only cover
+ * the instructions traced.
+ */
+#define PROF_MAX_DEPTH 1024
+
+typedef struct {
+  const FuncSym *func; // NULL for the root
+  int parent, child, sibling, depth;
+  uint64_t nr_inst, nr_call;
+} ProfNode;
+
+// before init_profile(), the root node alone counts everything
+static ProfNode prof_root = {};
+static ProfNode *prof_tree = &prof_root;
+static int nr_prof_node = 1, prof_cap = 0, prof_cur = 0;
+// the calls not shadowed beyond PROF_MAX_DEPTH
+static int prof_lost = 0;
+static FILE *prof_fp = NULL;
+
+static int prof_child(int parent, const FuncSym *f) {
+  int n;
+  for (n = prof_tree[parent].child; n != 0; n = prof_tree[n].sibling) {
+    if (prof_tree[n].func == f) return n;
+  }
+  if (nr_prof_node == prof_cap) {
+    prof_cap *= 2;
+    prof_tree = realloc(prof_tree, sizeof(ProfNode) * prof_cap);
+    assert(prof_tree);
+  }
+  n = nr_prof_node ++;
+  prof_tree[n] = (ProfNode) { .func = f, .parent = parent, .child = 0,
+    .sibling = prof_tree[parent].child, .depth = prof_tree[parent].depth + 1 };
+  prof_tree[parent].child = n;
+  return n;
+}
 
-  for (int i = 0; i < symbol_count; i++) {
-    if (ELF32_ST_TYPE(sym_tbl[i].st_info) != STT_FUNC) {
-      continue;
-    }
-    uint32_t fstart = sym_tbl[i].st_value;
-    if (pc >= fstart && pc < (fstart + sym_tbl[i].st_size)) {
-      pcfid = i;
-    } else if (snpc >= fstart && snpc < (fstart + sym_tbl[i].st_size)) {
-      snpcfid = i;
-      if (snpc == fstart) {
-        snpc_begin = true;
-      } else {
-        snpc_begin = false;
-      }
-    }
+static void prof_switch(const FuncSym *f, bool is_call) {
+  if (is_call) {
+    if (prof_tree[prof_cur].depth == PROF_MAX_DEPTH) { prof_lost ++; return; }
+    prof_cur = prof_child(prof_cur, f);
+    prof_tree[prof_cur].nr_call ++;
+    return;
   }
+  for (int n = prof_cur; n != 0; n = prof_tree[n].parent) {
+    if (prof_tree[n].func == f) { prof_cur = n; return; }
+  }
+  // not on the stack, e.g. after a longjmp, so replace the top
+  prof_cur = prof_child(prof_tree[prof_cur].parent, f);
+}
+
+static void prof_return(const FuncSym *f) {
+  if (prof_lost > 0) { prof_lost --; return; }
+  int parent = prof_tree[prof_cur].parent;
+  if (parent != 0 && prof_tree[parent].func == f) prof_cur = parent;
+  else prof_switch(f, false);
+}
+
+static void prof_write_stack(int n) {
+  if (n == 0) return;
+  prof_write_stack(prof_tree[n].parent);
+  fprintf(prof_fp, "%s%s", prof_tree[n].parent == 0 ? "" : ";", prof_tree[n].func->name);
+}
+
+static int prof_cmp(const void *a, const void *b) {
+  const uint64_t *sa = a, *sb = b;
+  return (sa[0] < sb[0]) - (sa[0] > sb[0]);
+}
 
-  if (pcfid != -1 && snpcfid != -1 && pcfid != snpcfid) {
-    if (snpc_begin == true) {
-      FTRACE_Log("0x%08x ", pc);
-      PRINT_INDENT(indent_cnt);
-      FTRACE_Log_newline("call[%s@0x%08x]", (str_tbl + sym_tbl[snpcfid].st_name), snpc);
-      indent_cnt++;
-    } else {
-      FTRACE_Log("0x%08x ", pc);
-      PRINT_INDENT(indent_cnt - 1);
-      FTRACE_Log_newline("ret[%s]", (str_tbl + sym_tbl[pcfid].st_name));
-      indent_cnt--;
+static void close_profile() {
+  // folded stacks
+  if (prof_tree[0].nr_inst != 0) fprintf(prof_fp, "[unknown] %" PRIu64 "\n", prof_tree[0].nr_inst);
+  for (int n = 1; n < nr_prof_node; n ++) {
+    if (prof_tree[n].nr_inst == 0) continue;
+    prof_write_stack(n);
+    fprintf(prof_fp, " %" PRIu64 "\n", prof_tree[n].nr_inst);
+  }
+  fclose(prof_fp);
+
+  // a child is always created after its parent
+  uint64_t *total = malloc(sizeof(uint64_t) * nr_prof_node);
+  assert(total);
+  for (int n = 0; n < nr_prof_node; n ++) total[n] = prof_tree[n].nr_inst;
+  for (int n = nr_prof_node - 1; n > 0; n --) total[prof_tree[n].parent] += total[n];
+
+  // {self, inclusive, calls, function} of each function
+  uint64_t (*stat)[4] = calloc(nr_func, sizeof(*stat));
+  assert(stat);
+  for (int i = 0; i < nr_func; i ++) stat[i][3] = i;
+  for (int n = 1; n < nr_prof_node; n ++) {
+    int i = prof_tree[n].func - func_tbl;
+    stat[i][0] += prof_tree[n].nr_inst;
+    stat[i][2] += prof_tree[n].nr_call;
+    // do not count the recursive calls twice
+    int a;
+    for (a = prof_tree[n].parent; a != 0 && prof_tree[a].func != prof_tree[n].func; a = prof_tree[a].parent);
+    if (a == 0) stat[i][1] += total[n];
+  }
+  qsort(stat, nr_func, sizeof(*stat), prof_cmp);
+
+  printf("Flat profile, in guest instructions (%" PRIu64 " in total):\n", total[0]);
+  printf("%7s %14s %14s %10s  %s\n", "%self", "self", "inclusive", "calls", "function");
+  for (int i = 0; i < nr_func; i ++) {
+    if (stat[i][1] == 0) continue;
+    printf("%7.2f %14" PRIu64 " %14" PRIu64 " %10" PRIu64 "  %s\n",
+        total[0] ? stat[i][0] * 100.0 / total[0] : 0, stat[i][0], stat[i][1], stat[i][2],
+        func_tbl[stat[i][3]].name);
+  }
+  free(stat);
+  free(total);
+}
+
+void init_profile(const char *file) {
+  if (file == NULL) return;
+  Assert(nr_func > 0, "--profile needs the function symbols of an elf file");
+  prof_fp = fopen(file, "w");
+  Assert(prof_fp, "Can not open '%s'", file);
+  prof_cap = 1024;
+  prof_tree = malloc(sizeof(ProfNode) * prof_cap);
+  assert(prof_tree);
+  prof_tree[0] = prof_root;
+  atexit(close_profile);
+  Log("The profile is written to %s", file);
+}
+
+/* Calls and returns are told by the ISA from the instruction, so direct
+ * recursion is seen, and a jump to the start of a function is not a call.
+ * The function of the last traced instruction is remembered together with
+ * its range, so the index is only searched when the control leaves it.
+ */
+static const FuncSym *cur_func = NULL;
+static vaddr_t cur_lo = 0, cur_hi = 0;
+
+int find_stat(vaddr_t pc, vaddr_t snpc, struct Decode *s) {
+  bool is_call = isa_inst_is_call(s), is_ret = isa_inst_is_ret(s);
+  bool stay = (snpc - cur_lo < cur_hi - cur_lo && pc - cur_lo < cur_hi - cur_lo);
+  if (likely(stay && !is_call && !is_ret)) {
+    prof_tree[prof_cur].nr_inst ++;
+    return 0;
+  }
+
+  const FuncSym *pcf, *snpcf;
+  if (stay) {
+    pcf = snpcf = cur_func;
+  } else {
+    // tracing may have been turned off for a while
+    if (!(pc - cur_lo < cur_hi - cur_lo)) cur_func = func_lookup(pc, &cur_lo, &cur_hi);
+    pcf = cur_func;
+    vaddr_t lo, hi;
+    snpcf = func_lookup(snpc, &lo, &hi);
+    cur_func = snpcf;
+    cur_lo = lo;
+    cur_hi = hi;
+  }
+
+  // only the calls and returns between known functions are traced
+  if (pcf == NULL || snpcf == NULL) is_call = is_ret = false;
+
+  if (prof_fp != NULL) {
+    // the entry function is never called
+    if (prof_cur == 0 && pcf != NULL) prof_cur = prof_child(0, pcf);
+    prof_tree[prof_cur].nr_inst ++;
+    if (is_call) prof_switch(snpcf, true);
+    else if (is_ret) prof_return(snpcf);
+    // e.g. a tail call
+    else if (snpcf != NULL && snpcf != pcf) prof_switch(snpcf, false);
+  }
+
+#ifdef CONFIG_ITRACE
+  // they go to the --itrace file instead if it is given
+  if (itrace_file_on) {
+    extern uint64_t g_nr_guest_inst;
+    extern bool log_enable();
+    if ((is_call || is_ret) && log_enable()) {
+      itrace_file_func(g_nr_guest_inst, is_call, pc, snpc, (is_call ? snpcf : pcf) - func_tbl);
     }
+    return 0;
+  }
+#endif
+
+  if (is_call) {
+    FTRACE_Log(FMT_WORD " ", pc);
+    PRINT_INDENT(indent_cnt);
+    FTRACE_Log_newline("call[%s@" FMT_WORD "]", snpcf->name, snpc);
+    indent_cnt++;
+  } else if (is_ret) {
+    FTRACE_Log(FMT_WORD " ", pc);
+    PRINT_INDENT(indent_cnt - 1);
+    FTRACE_Log_newline("ret[%s]", pcf->name);
+    indent_cnt--;
   }
 
   return 0;
@@ -0,0 +1,174 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <common.h>
+#include <itrace-file.h>
+#include <pthread.h>
+
+/* The CPU fills blocks of records and hands them to a writer thread, which
+ * compresses and writes them, so the CPU only waits when all NR_BLOCK
+ * blocks are waiting for the writer. The blocks are passed in order: the
+ * CPU fills block[head % NR_BLOCK] and the writer takes the blocks in
+ * [tail, head). The index is kept by the writer and written at exit,
+ * together with the names of the functions.
+ */
+
+int elf_nr_func();
+const char *elf_func_name(int i);
+
+#define NR_BLOCK 8
+#define BLOCK_SIZE (ITRACE_BLOCK_RECORDS * sizeof(ItraceRecord))
+
+typedef struct {
+  uint64_t first_inst;
+  uint32_t nr_record;
+  ItraceRecord rec[ITRACE_BLOCK_RECORDS];
+} Block;
+
+static Block block[NR_BLOCK];
+static uint64_t head = 0, tail = 0;
+static bool writer_stop = false;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static pthread_t writer;
+static FILE *itrace_fp = NULL;
+static uint64_t last_inst = 0;
+
+bool itrace_file_on = false;
+
+static ItraceIndexEntry *idx = NULL;
+static uint64_t nr_idx = 0, idx_cap = 0;
+static uint64_t raw_size = 0, file_size = 0;
+
+static void write_block(Block *b, uint8_t *buf) {
+  size_t raw = b->nr_record * sizeof(ItraceRecord);
+  size_t size = lz_compress(b->rec, raw, buf, raw);
+  ItraceBlockHeader h = { .first_inst = b->first_inst, .nr_record = b->nr_record,
+    .size = (size == 0 ? raw : size) };
+
+  if (nr_idx == idx_cap) {
+    idx_cap = (idx_cap == 0 ? 1024 : idx_cap * 2);
+    idx = realloc(idx, sizeof(ItraceIndexEntry) * idx_cap);
+    assert(idx);
+  }
+  idx[nr_idx ++] = (ItraceIndexEntry) { .first_inst = b->first_inst, .offset = file_size };
+
+  bool ok = fwrite(&h, sizeof(h), 1, itrace_fp) == 1 &&
+    fwrite(size == 0 ? (void *)b->rec : buf, h.size, 1, itrace_fp) == 1;
+  Assert(ok, "fail to write the itrace file");
+  file_size += sizeof(h) + h.size;
+  raw_size += raw;
+}
+
+static void *writer_thread(void *arg) {
+  static uint8_t buf[BLOCK_SIZE];
+  pthread_mutex_lock(&lock);
+  while (true) {
+    while (tail == head && !writer_stop) pthread_cond_wait(&cond, &lock);
+    if (tail == head) break;
+    Block *b = &block[tail % NR_BLOCK];
+    pthread_mutex_unlock(&lock);
+    write_block(b, buf);
+    pthread_mutex_lock(&lock);
+    tail ++;
+    pthread_cond_broadcast(&cond);
+  }
+  pthread_mutex_unlock(&lock);
+  return NULL;
+}
+
+static void submit_block() {
+  pthread_mutex_lock(&lock);
+  head ++;
+  pthread_cond_broadcast(&cond);
+  // wait for the next block to be written
+  while (head - tail == NR_BLOCK) pthread_cond_wait(&cond, &lock);
+  pthread_mutex_unlock(&lock);
+  block[head % NR_BLOCK].nr_record = 0;
+}
+
+// a full block is submitted when the next record comes, or at exit
+static ItraceRecord *new_record(uint64_t nr_inst, int kind, vaddr_t pc) {
+  Block *b = &block[head % NR_BLOCK];
+  // the first record of a block is numbered by the block, so a gap too
+  // long for `delta` starts a new block
+  if (b->nr_record == ITRACE_BLOCK_RECORDS ||
+      (b->nr_record != 0 && nr_inst - last_inst > UINT32_MAX)) {
+    submit_block();
+    b = &block[head % NR_BLOCK];
+  }
+  if (b->nr_record == 0) b->first_inst = nr_inst;
+  ItraceRecord *r = &b->rec[b->nr_record ++];
+  *r = (ItraceRecord) { .pc = pc, .delta = nr_inst - last_inst, .kind = kind };
+  last_inst = nr_inst;
+  return r;
+}
+
+// `nr_inst` is the number of instructions executed before this one
+void itrace_file_write(uint64_t nr_inst, vaddr_t pc, const void *inst, int ilen) {
+  ItraceRecord *r = new_record(nr_inst, ITRACE_REC_INST, pc);
+  r->ilen = (ilen < ITRACE_MAX_ILEN ? ilen : ITRACE_MAX_ILEN);
+  memcpy(r->inst, inst, r->ilen);
+}
+
+// `func` is the index of the callee or the returning function, see elf_func_name()
+void itrace_file_func(uint64_t nr_inst, bool is_call, vaddr_t pc, vaddr_t target, int func) {
+  ItraceRecord *r = new_record(nr_inst, is_call ? ITRACE_REC_CALL : ITRACE_REC_RET, pc);
+  r->fn.target = target;
+  r->fn.func = func;
+}
+
+// also called when NEMU aborts, where the atexit() handlers are skipped
+void close_itrace_file() {
+  if (itrace_fp == NULL || pthread_equal(pthread_self(), writer)) return;
+  itrace_file_on = false;
+  if (block[head % NR_BLOCK].nr_record != 0) submit_block();
+  pthread_mutex_lock(&lock);
+  writer_stop = true;
+  pthread_cond_broadcast(&cond);
+  pthread_mutex_unlock(&lock);
+  pthread_join(writer, NULL);
+
+  bool ok = fwrite(idx, sizeof(ItraceIndexEntry), nr_idx, itrace_fp) == nr_idx;
+  ItraceFileFooter f = { .index_offset = file_size, .nr_block = nr_idx,
+    .func_offset = file_size + sizeof(ItraceIndexEntry) * nr_idx, .nr_func = elf_nr_func(),
+    .magic = ITRACE_FILE_MAGIC };
+  for (int i = 0; i < f.nr_func && ok; i ++) {
+    const char *name = elf_func_name(i);
+    ok = fwrite(name, strlen(name) + 1, 1, itrace_fp) == 1;
+  }
+  ok = ok && fwrite(&f, sizeof(f), 1, itrace_fp) == 1;
+  Assert(ok, "fail to write the itrace file");
+  fclose(itrace_fp);
+  itrace_fp = NULL;
+  Log("itrace: %" PRIu64 " blocks, %" PRIu64 " bytes are compressed to %" PRIu64,
+      nr_idx, raw_size, file_size);
+}
+
+void init_itrace_file(const char *file) {
+  if (file == NULL) return;
+  itrace_fp = fopen(file, "wb");
+  Assert(itrace_fp, "Can not open '%s'", file);
+  ItraceFileHeader h = { .magic = ITRACE_FILE_MAGIC, .version = ITRACE_FILE_VERSION,
+    .record_size = sizeof(ItraceRecord), .isa = str(__GUEST_ISA__) };
+  bool ok = fwrite(&h, sizeof(h), 1, itrace_fp) == 1;
+  Assert(ok, "fail to write the itrace file");
+  file_size = sizeof(h);
+  int ret = pthread_create(&writer, NULL, writer_thread, NULL);
+  Assert(ret == 0, "Can not create the itrace writer");
+  atexit(close_itrace_file);
+  itrace_file_on = true;
+  Log("itrace is written to %s", file);
+}
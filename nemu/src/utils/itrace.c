@@ -0,0 +1,116 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <common.h>
+#include <pthread.h>
+
+/* Every traced instruction is recorded as its pc and raw bytes into a
+ * ring. Nothing is formatted or disassembled when recording. The records
+ * marked to be logged are disassembled and written to the log in batches,
+ * when the ring is full, when the execution stops, or before any other
+ * line is logged (see log_write()) to keep the log in execution order. The
+ * ring also keeps the instructions executed before NEMU aborts. The ring
+ * belongs to the CPU thread, so the lines logged by other threads do not
+ * flush it, and are not ordered with the instructions anyway.
+ */
+
+#define ITRACE_RING_SIZE 4096
+#define ITRACE_MAX_ILEN MUXDEF(CONFIG_ISA_x86, 16, 4)
+
+static_assert(CONFIG_ITRACE_IRINGBUF <= ITRACE_RING_SIZE, "ITRACE_IRINGBUF is too large");
+
+typedef struct {
+  vaddr_t pc;
+  uint8_t ilen;
+  bool log;
+  uint8_t inst[ITRACE_MAX_ILEN];
+} ITraceRecord;
+
+static ITraceRecord ring[ITRACE_RING_SIZE];
+// the records in [nr_flushed, nr_record) may still need to be logged
+static uint64_t nr_record = 0, nr_flushed = 0;
+
+static pthread_t cpu_thread;
+
+extern FILE *log_fp;
+
+void itrace_format(char *buf, int size, vaddr_t pc, const uint8_t *inst, int ilen) {
+  char *p = buf;
+  p += snprintf(p, size, FMT_WORD ":", pc);
+  int i;
+#ifdef CONFIG_ISA_x86
+  for (i = 0; i < ilen; i ++) {
+#else
+  for (i = ilen - 1; i >= 0; i --) {
+#endif
+    p += snprintf(p, 4, " %02x", inst[i]);
+  }
+  int ilen_max = MUXDEF(CONFIG_ISA_x86, 8, 4);
+  int space_len = ilen_max - ilen;
+  if (space_len < 0) space_len = 0;
+  space_len = space_len * 3 + 1;
+  memset(p, ' ', space_len);
+  p += space_len;
+
+  void disassemble(char *str, int size, uint64_t pc, uint8_t *code, int nbyte);
+  disassemble(p, buf + size - p,
+      MUXDEF(CONFIG_ISA_x86, pc + ilen, pc), (uint8_t *)inst, ilen);
+}
+
+void itrace_flush() {
+  if (!pthread_equal(pthread_self(), cpu_thread)) return;
+  for (; nr_flushed < nr_record; nr_flushed ++) {
+    ITraceRecord *r = &ring[nr_flushed % ITRACE_RING_SIZE];
+    if (!r->log) continue;
+    char buf[128];
+    itrace_format(buf, sizeof(buf), r->pc, r->inst, r->ilen);
+    log_printf("%s\n", buf);
+  }
+}
+
+void itrace_record(vaddr_t pc, const void *inst, int ilen, bool log) {
+  // the records to log go to the --itrace file instead if it is given
+  if (log && itrace_file_on) {
+    extern uint64_t g_nr_guest_inst;
+    itrace_file_write(g_nr_guest_inst - 1, pc, inst, ilen);
+    log = false;
+  }
+  if (unlikely(nr_record - nr_flushed == ITRACE_RING_SIZE)) itrace_flush();
+  ITraceRecord *r = &ring[nr_record ++ % ITRACE_RING_SIZE];
+  r->pc = pc;
+  r->ilen = (ilen < ITRACE_MAX_ILEN ? ilen : ITRACE_MAX_ILEN);
+  r->log = log && log_fp != NULL;
+  memcpy(r->inst, inst, r->ilen);
+}
+
+// the instructions are recorded on the calling thread
+void init_itrace() {
+  cpu_thread = pthread_self();
+}
+
+// show the last CONFIG_ITRACE_IRINGBUF instructions
+void itrace_dump_ring() {
+  itrace_flush();
+  log_flush();
+  int n = (nr_record < CONFIG_ITRACE_IRINGBUF ? nr_record : CONFIG_ITRACE_IRINGBUF);
+  if (n == 0) return;
+  printf("The last %d instructions executed:\n", n);
+  for (uint64_t i = nr_record - n; i < nr_record; i ++) {
+    char buf[128];
+    ITraceRecord *r = &ring[i % ITRACE_RING_SIZE];
+    itrace_format(buf, sizeof(buf), r->pc, r->inst, r->ilen);
+    printf("%s %s\n", (i == nr_record - 1 ? "-->" : "   "), buf);
+  }
+}
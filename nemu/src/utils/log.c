@@ -18,15 +18,141 @@
 extern uint64_t g_nr_guest_inst;
 
 #ifndef CONFIG_TARGET_AM
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+/* The log is written by a writer thread. The lines are passed through a
+ * bounded multi-producer single-consumer queue of slots. A producer
+ * claims as many consecutive slots as its line needs by bumping `head`,
+ * and waits for each of them to be released by the writer. The sequence
+ * number of a slot tells whether it is free (== its position) or filled
+ * (== its position + 1). So the CPU and device threads never take a lock
+ * to log, and the lines of a thread are written in order. A slot also
+ * tells which file it goes to, so the copy of Log() lines on stdout is
+ * written by the writer as well. Before the writer is started and after
+ * it is stopped, the lines are written directly.
+ */
+
+#define NR_SLOT 8192
+#define SLOT_SIZE 128
+#define WRITER_SLEEP_US 1000
+
+typedef struct {
+  _Atomic uint64_t seq;
+  FILE *fp;
+  uint32_t len;
+  char buf[SLOT_SIZE - sizeof(uint64_t) - sizeof(FILE *) - sizeof(uint32_t)];
+} LogSlot;
+
+static LogSlot slot[NR_SLOT];
+static _Atomic uint64_t head = 0;
+static _Atomic uint64_t tail = 0;
+static atomic_bool writer_on = false;
+static atomic_bool writer_stop = false;
+static pthread_t writer;
+
 FILE *log_fp = NULL;
 
+static void log_push(FILE *fp, const char *str, size_t len) {
+  size_t cap = sizeof(slot[0].buf);
+  uint64_t n = (len + cap - 1) / cap;
+  uint64_t pos = atomic_fetch_add_explicit(&head, n, memory_order_relaxed);
+  for (; len > 0; pos ++) {
+    LogSlot *s = &slot[pos % NR_SLOT];
+    while (atomic_load_explicit(&s->seq, memory_order_acquire) != pos) sched_yield();
+    s->fp = fp;
+    s->len = (len < cap ? len : cap);
+    memcpy(s->buf, str, s->len);
+    str += s->len;
+    len -= s->len;
+    atomic_store_explicit(&s->seq, pos + 1, memory_order_release);
+  }
+}
+
+static void log_vprintf(FILE *fp, const char *fmt, va_list ap) {
+  if (!atomic_load_explicit(&writer_on, memory_order_acquire)) {
+    vfprintf(fp, fmt, ap);
+    return;
+  }
+
+  char buf[1024];
+  va_list ap2;
+  va_copy(ap2, ap);
+  int len = vsnprintf(buf, sizeof(buf), fmt, ap);
+  if (len >= 0 && len < sizeof(buf)) log_push(fp, buf, len);
+  else if (len >= 0) {
+    char *p = malloc(len + 1);
+    assert(p);
+    vsnprintf(p, len + 1, fmt, ap2);
+    log_push(fp, p, len);
+    free(p);
+  }
+  va_end(ap2);
+}
+
+void log_printf(const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  log_vprintf(log_fp, fmt, ap);
+  va_end(ap);
+}
+
+void log_stdout(const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  log_vprintf(stdout, fmt, ap);
+  va_end(ap);
+}
+
+static void *writer_thread(void *arg) {
+  while (true) {
+    uint64_t t = atomic_load_explicit(&tail, memory_order_relaxed);
+    LogSlot *s = &slot[t % NR_SLOT];
+    if (atomic_load_explicit(&s->seq, memory_order_acquire) != t + 1) {
+      fflush(log_fp);
+      fflush(stdout);
+      if (atomic_load(&writer_stop) && t == atomic_load(&head)) break;
+      usleep(WRITER_SLEEP_US);
+      continue;
+    }
+    fwrite(s->buf, s->len, 1, s->fp);
+    atomic_store_explicit(&s->seq, t + NR_SLOT, memory_order_release);
+    atomic_store_explicit(&tail, t + 1, memory_order_release);
+  }
+  return NULL;
+}
+
+// wait until all lines logged so far are written, e.g. before aborting
+void log_flush() {
+  if (atomic_load(&writer_on) && !pthread_equal(pthread_self(), writer)) {
+    uint64_t h = atomic_load(&head);
+    while (atomic_load_explicit(&tail, memory_order_acquire) < h) sched_yield();
+  }
+  if (log_fp != NULL) fflush(log_fp);
+  fflush(stdout);
+}
+
+static void close_log() {
+  atomic_store(&writer_on, false);
+  atomic_store(&writer_stop, true);
+  pthread_join(writer, NULL);
+}
+
 void init_log(const char *log_file) {
+  for (int i = 0; i < NR_SLOT; i ++) slot[i].seq = i;
   log_fp = stdout;
   if (log_file != NULL) {
     FILE *fp = fopen(log_file, "w");
     Assert(fp, "Can not open '%s'", log_file);
     log_fp = fp;
   }
+  int ret = pthread_create(&writer, NULL, writer_thread, NULL);
+  Assert(ret == 0, "Can not create the log writer");
+  atomic_store_explicit(&writer_on, true, memory_order_release);
+  atexit(close_log);
   Log("Log is written to %s", log_file ? log_file : "stdout");
 }
 
@@ -0,0 +1,128 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <itrace-file.h>
+#include <stdbool.h>
+#include <string.h>
+
+/* A small LZ77 codec in the spirit of LZ4. The data is a sequence of
+ *   token, [literal length], literals, offset, [match length]
+ * where the high and low 4 bits of the token are the number of literals
+ * and the match length minus LZ_MIN_MATCH. A field of 15 is continued by
+ * bytes of 255 and a final byte below 255. The offset is 2 bytes in little
+ * endian. The last sequence has only literals.
+ *
+ * This file is shared with tools/itrace-dump.
+ */
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 0xffff
+#define LZ_HASH_BITS 12
+
+static inline uint32_t load32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+static inline uint32_t lz_hash(uint32_t v) {
+  return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static uint8_t *put_len(uint8_t *op, size_t len) {
+  for (; len >= 255; len -= 255) *op ++ = 255;
+  *op ++ = len;
+  return op;
+}
+
+// emit the literals [lit, lit + nr_lit) followed by a match, if mlen != 0
+static uint8_t *put_seq(uint8_t *op, uint8_t *end, const uint8_t *lit, size_t nr_lit,
+    size_t offset, size_t mlen) {
+  size_t need = 1 + nr_lit / 255 + 1 + nr_lit + 2 + mlen / 255 + 1;
+  if (op == NULL || (size_t)(end - op) < need) return NULL;
+  size_t m = (mlen == 0 ? 0 : mlen - LZ_MIN_MATCH);
+  uint8_t *token = op ++;
+  *token = ((nr_lit < 15 ? nr_lit : 15) << 4) | (m < 15 ? m : 15);
+  if (nr_lit >= 15) op = put_len(op, nr_lit - 15);
+  memcpy(op, lit, nr_lit);
+  op += nr_lit;
+  if (mlen == 0) return op;
+  *op ++ = offset & 0xff;
+  *op ++ = offset >> 8;
+  if (m >= 15) op = put_len(op, m - 15);
+  return op;
+}
+
+size_t lz_compress(const void *src, size_t len, void *dst, size_t cap) {
+  const uint8_t *in = src;
+  uint8_t *op = dst, *end = op + cap;
+  uint32_t table[1 << LZ_HASH_BITS];
+  memset(table, 0, sizeof(table));
+
+  size_t anchor = 0, i = 0;
+  while (i + LZ_MIN_MATCH <= len) {
+    uint32_t v = load32(in + i);
+    uint32_t h = lz_hash(v);
+    size_t cand = table[h];
+    table[h] = i;
+    if (cand < i && i - cand <= LZ_MAX_OFFSET && load32(in + cand) == v) {
+      size_t mlen = LZ_MIN_MATCH;
+      while (i + mlen < len && in[cand + mlen] == in[i + mlen]) mlen ++;
+      op = put_seq(op, end, in + anchor, i - anchor, i - cand, mlen);
+      i += mlen;
+      anchor = i;
+    } else {
+      i ++;
+    }
+  }
+  op = put_seq(op, end, in + anchor, len - anchor, 0, 0);
+  return (op == NULL ? 0 : op - (uint8_t *)dst);
+}
+
+static bool get_len(const uint8_t **ip, const uint8_t *end, size_t *len) {
+  uint8_t b;
+  do {
+    if (*ip == end) return false;
+    b = *(*ip) ++;
+    *len += b;
+  } while (b == 255);
+  return true;
+}
+
+size_t lz_decompress(const void *src, size_t len, void *dst, size_t cap) {
+  const uint8_t *ip = src, *iend = ip + len;
+  uint8_t *op = dst, *oend = op + cap;
+  while (ip < iend) {
+    uint8_t token = *ip ++;
+    size_t nr_lit = token >> 4;
+    if (nr_lit == 15 && !get_len(&ip, iend, &nr_lit)) return (size_t)-1;
+    if ((size_t)(iend - ip) < nr_lit || (size_t)(oend - op) < nr_lit) return (size_t)-1;
+    memcpy(op, ip, nr_lit);
+    ip += nr_lit;
+    op += nr_lit;
+    if (ip == iend) break;
+
+    if (iend - ip < 2) return (size_t)-1;
+    size_t offset = ip[0] | (ip[1] << 8);
+    ip += 2;
+    size_t mlen = token & 0xf;
+    if (mlen == 15 && !get_len(&ip, iend, &mlen)) return (size_t)-1;
+    mlen += LZ_MIN_MATCH;
+    if (offset == 0 || offset > (size_t)(op - (uint8_t *)dst) || (size_t)(oend - op) < mlen) return (size_t)-1;
+    // the match may overlap the bytes it produces
+    for (const uint8_t *m = op - offset; mlen > 0; mlen --) *op ++ = *m ++;
+  }
+  return op - (uint8_t *)dst;
+}
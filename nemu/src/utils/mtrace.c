@@ -0,0 +1,167 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <isa.h>
+#include <memory/paddr.h>
+#include <device/mmio.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+/* The records are passed from the CPU to a writer thread through a single
+ * producer single consumer ring. `head` is only written by the CPU and
+ * `tail` only by the writer, so no lock is needed. The writer sleeps a
+ * while when the ring is empty, and the CPU waits for it when the ring is
+ * full, so that no record is dropped. If the file can not be written, the
+ * writer stops, and the records after it are dropped.
+ *
+ * Without any filter, `mtrace_on` is false and a data access only tests it.
+ */
+
+#define RING_SIZE CONFIG_MTRACE_RING_SIZE
+#define NR_FILTER 8
+#define WRITER_SLEEP_US 1000
+
+static_assert((RING_SIZE & (RING_SIZE - 1)) == 0, "MTRACE_RING_SIZE must be a power of 2");
+
+static MTraceRecord ring[RING_SIZE];
+static _Atomic uint64_t head = 0, tail = 0;
+static atomic_bool writer_stop = false, writer_fail = false;
+static pthread_t writer;
+static FILE *mtrace_fp = NULL;
+
+static struct {
+  paddr_t low, high;
+  char spec[32];
+} filter[NR_FILTER];
+static int nr_filter = 0;
+
+bool mtrace_on = false;
+
+void mtrace_record(vaddr_t pc, paddr_t addr, int len, word_t data, bool is_write) {
+  int i;
+  for (i = 0; i < nr_filter; i ++) {
+    // [addr, addr + len) overlaps [low, high], without overflow
+    if (addr <= filter[i].high && (addr >= filter[i].low || filter[i].low - addr < len)) break;
+  }
+  if (i == nr_filter) return;
+
+  uint64_t h = atomic_load_explicit(&head, memory_order_relaxed);
+  while (h - atomic_load_explicit(&tail, memory_order_acquire) == RING_SIZE) {
+    if (atomic_load(&writer_fail)) return;
+    sched_yield();
+  }
+  ring[h & (RING_SIZE - 1)] = (MTraceRecord) { .pc = pc, .addr = addr, .data = data,
+    .len = len, .is_write = is_write };
+  atomic_store_explicit(&head, h + 1, memory_order_release);
+}
+
+static void *writer_thread(void *arg) {
+  while (true) {
+    uint64_t t = atomic_load_explicit(&tail, memory_order_relaxed);
+    uint64_t h = atomic_load_explicit(&head, memory_order_acquire);
+    if (h == t) {
+      // the CPU has stopped producing before asking to stop
+      if (atomic_load(&writer_stop)) break;
+      usleep(WRITER_SLEEP_US);
+      continue;
+    }
+    // write the part which does not wrap around at once
+    uint64_t idx = t & (RING_SIZE - 1);
+    uint64_t n = h - t;
+    if (idx + n > RING_SIZE) n = RING_SIZE - idx;
+    size_t ret = fwrite(&ring[idx], sizeof(MTraceRecord), n, mtrace_fp);
+    atomic_store_explicit(&tail, t + ret, memory_order_release);
+    if (ret != n) {
+      // do not abort NEMU from this thread
+      Log(ANSI_FMT("mtrace: fail to write the file, the trace stops here", ANSI_FG_RED));
+      atomic_store(&writer_fail, true);
+      break;
+    }
+  }
+  fflush(mtrace_fp);
+  return NULL;
+}
+
+// also called when NEMU aborts, where the atexit() handlers are skipped
+void close_mtrace() {
+  if (mtrace_fp == NULL || pthread_equal(pthread_self(), writer)) return;
+  mtrace_on = false;
+  atomic_store(&writer_stop, true);
+  pthread_join(writer, NULL);
+  fclose(mtrace_fp);
+  mtrace_fp = NULL;
+  Log("mtrace: %" PRIu64 " records are written", atomic_load(&tail));
+}
+
+static void update_mtrace_on() {
+  mtrace_on = (mtrace_fp != NULL && nr_filter > 0);
+}
+
+bool mtrace_add_filter(const char *spec) {
+  if (nr_filter == NR_FILTER) { printf("mtrace: too many filters\n"); return false; }
+  paddr_t low, high;
+  char *end;
+  low = strtoull(spec, &end, 0);
+  if (end != spec && *end == '-') {
+    char *p = end + 1;
+    high = strtoull(p, &end, 0);
+    if (end == p || *end != '\0' || high < low) return false;
+  } else if (strcmp(spec, "pmem") == 0) {
+    low = PMEM_LEFT; high = PMEM_RIGHT;
+  } else if (!MUXDEF(CONFIG_DEVICE, mmio_find_map(spec, &low, &high), false)) {
+    return false;
+  }
+  filter[nr_filter].low = low;
+  filter[nr_filter].high = high;
+  snprintf(filter[nr_filter].spec, sizeof(filter[0].spec), "%s", spec);
+  nr_filter ++;
+  update_mtrace_on();
+  return true;
+}
+
+void mtrace_clear_filter() {
+  nr_filter = 0;
+  update_mtrace_on();
+}
+
+void mtrace_display_filter() {
+  if (mtrace_fp == NULL) printf("mtrace: no file is given by --mtrace\n");
+  for (int i = 0; i < nr_filter; i ++) {
+    printf("%d: %s [" FMT_PADDR ", " FMT_PADDR "]\n", i, filter[i].spec, filter[i].low, filter[i].high);
+  }
+}
+
+// `filters` is a list of SPEC separated by commas
+void init_mtrace(const char *file, const char *filters) {
+  if (filters != NULL) {
+    char *buf = strdup(filters);
+    for (char *spec = strtok(buf, ","); spec != NULL; spec = strtok(NULL, ",")) {
+      bool ok = mtrace_add_filter(spec);
+      Assert(ok, "Invalid filter '%s' of --mtrace-filter", spec);
+    }
+    free(buf);
+  }
+  if (file == NULL) return;
+
+  mtrace_fp = fopen(file, "wb");
+  Assert(mtrace_fp, "Can not open '%s'", file);
+  int ret = pthread_create(&writer, NULL, writer_thread, NULL);
+  Assert(ret == 0, "Can not create the mtrace writer");
+  atexit(close_mtrace);
+  update_mtrace_on();
+  Log("mtrace is written to %s", file);
+}
@@ -44,6 +44,15 @@ uint64_t get_time() {
   return now - boot_time;
 }
 
+uint64_t get_guest_time() {
+#ifdef CONFIG_ICOUNT
+  extern uint64_t g_nr_guest_inst;
+  return g_nr_guest_inst / CONFIG_ICOUNT_RATE;
+#else
+  return get_time();
+#endif
+}
+
 void init_rand() {
   srand(get_time_internal());
 }
@@ -0,0 +1,322 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+/* Generate decode trees from the INSTPAT tables of an ISA.
+ *
+ * The input is the preprocessed `inst.c` built with `-D__INSTPAT_GEN__`,
+ * where `include/cpu/decode.h` turns every table into
+ *   __instpat_start__(name) __instpat__("pattern", "inst", line) ... __instpat_end__(name)
+ * For each table, a function `__instpat_tree_<name>(inst)` is written to
+ * stdout. It returns the source line of the first pattern in the table
+ * matching `inst`, or -1 if nothing matches. It is a nested switch on fixed
+ * fields of the instruction, so the cost of decoding no longer depends on
+ * where the pattern of an instruction sits in the table. At last, the
+ * macro `__instpat_line_ok(l)` tells whether `l` is the line of a pattern
+ * in any table, which decode.h checks for every pattern.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <assert.h>
+
+#define MAX_PAT 1024
+#define MAX_FIELD_WIDTH 12
+
+typedef struct {
+  uint64_t key, mask;
+  int line;
+  char name[64];
+} Pattern;
+
+static Pattern pat[MAX_PAT];
+static int nr_pat = 0;
+// the lines of the patterns in all tables
+static int all_line[MAX_PAT];
+static int nr_all_line = 0;
+static char table_name[64] = "";
+
+static char *input = NULL;
+static char *p = NULL;
+
+static void die(const char *msg) {
+  fprintf(stderr, "gen-decode: %s\n", msg);
+  exit(1);
+}
+
+static char *read_all(FILE *fp) {
+  size_t cap = 1 << 16, len = 0;
+  char *buf = malloc(cap);
+  assert(buf);
+  size_t n;
+  while ((n = fread(buf + len, 1, cap - len - 1, fp)) > 0) {
+    len += n;
+    if (len + 1 == cap) {
+      cap *= 2;
+      buf = realloc(buf, cap);
+      assert(buf);
+    }
+  }
+  buf[len] = '\0';
+  return buf;
+}
+
+static void skip_space() {
+  while (isspace(*p)) p ++;
+}
+
+static void expect(char c) {
+  skip_space();
+  if (*p != c) {
+    char msg[64];
+    sprintf(msg, "expect '%c' near \"%.20s\"", c, p);
+    die(msg);
+  }
+  p ++;
+}
+
+// read adjacent string literals as one string
+static void read_string(char *dst, int size) {
+  int len = 0;
+  skip_space();
+  if (*p != '"') die("expect a string literal");
+  while (*p == '"') {
+    p ++;
+    while (*p != '"') {
+      if (*p == '\0') die("unterminated string literal");
+      if (*p == '\\') p ++;
+      if (len + 1 >= size) die("string literal too long");
+      dst[len ++] = *p ++;
+    }
+    p ++;
+    skip_space();
+  }
+  dst[len] = '\0';
+}
+
+static int read_int() {
+  skip_space();
+  if (!isdigit(*p)) die("expect a line number");
+  return strtol(p, &p, 10);
+}
+
+static void read_ident(char *dst, int size) {
+  int len = 0;
+  skip_space();
+  while (isalnum(*p) || *p == '_') {
+    if (len + 1 >= size) die("identifier too long");
+    dst[len ++] = *p ++;
+  }
+  dst[len] = '\0';
+}
+
+// the same semantic as pattern_decode() in include/cpu/decode.h
+static void add_pattern(const char *str, const char *name, int line) {
+  if (nr_pat >= MAX_PAT || nr_all_line >= MAX_PAT) die("too many patterns");
+  int nbits = 0;
+  for (const char *s = str; *s; s ++) {
+    if (*s != ' ') nbits ++;
+  }
+  if (nbits > 64) die("pattern too long");
+
+  Pattern *t = &pat[nr_pat ++];
+  t->key = t->mask = 0;
+  int bit = nbits - 1;
+  for (const char *s = str; *s; s ++) {
+    switch (*s) {
+      case ' ': continue;
+      case '1': t->key |= 1ull << bit; // fall through
+      case '0': t->mask |= 1ull << bit; break;
+      case '?': break;
+      default: die("invalid character in pattern string");
+    }
+    bit --;
+  }
+  snprintf(t->name, sizeof(t->name), "%s", name);
+  t->line = line;
+  all_line[nr_all_line ++] = line;
+}
+
+/* ---------------- tree construction ---------------- */
+
+static void indent(int level) {
+  printf("%*s", level * 2, "");
+}
+
+static int field_lo(uint64_t m) { return __builtin_ctzll(m); }
+
+// pick the lowest run of consecutive bits in `m`, at most MAX_FIELD_WIDTH wide
+static uint64_t lowest_run(uint64_t m) {
+  int lo = field_lo(m);
+  int w = 0;
+  while (lo + w < 64 && (m >> (lo + w) & 1) && w < MAX_FIELD_WIDTH) w ++;
+  return (w == 64 ? ~0ull : ((1ull << w) - 1)) << lo;
+}
+
+static void gen_node(int *list, int n, uint64_t tested, int level);
+
+static void gen_switch(int *list, int n, uint64_t tested, uint64_t field, int level) {
+  int lo = field_lo(field);
+  int w = __builtin_popcountll(field);
+  int nr_val = 1 << w;
+
+  // sub[v * n ...] is the list of patterns which may still match when the field is v
+  int *sub = malloc(sizeof(int) * n * nr_val);
+  int *nr_sub = calloc(nr_val, sizeof(int));
+  int *group = malloc(sizeof(int) * nr_val);
+  assert(sub && nr_sub && group);
+
+  for (int v = 0; v < nr_val; v ++) {
+    uint64_t fv = (uint64_t)v << lo;
+    for (int i = 0; i < n; i ++) {
+      Pattern *t = &pat[list[i]];
+      if (((fv ^ t->key) & t->mask & field) == 0) sub[v * n + nr_sub[v] ++] = list[i];
+    }
+  }
+
+  // values with the same candidates share one subtree
+  int nr_group = 0;
+  int *leader = malloc(sizeof(int) * nr_val);
+  int *size = calloc(nr_val, sizeof(int));
+  assert(leader && size);
+  for (int v = 0; v < nr_val; v ++) {
+    int g;
+    for (g = 0; g < nr_group; g ++) {
+      int u = leader[g];
+      if (nr_sub[u] == nr_sub[v] && memcmp(&sub[u * n], &sub[v * n], sizeof(int) * nr_sub[v]) == 0) break;
+    }
+    if (g == nr_group) leader[nr_group ++] = v;
+    group[v] = g;
+    size[g] ++;
+  }
+  int dflt = 0;
+  for (int g = 1; g < nr_group; g ++) {
+    if (size[g] > size[dflt]) dflt = g;
+  }
+
+  indent(level);
+  printf("switch ((inst >> %d) & 0x%llx) {\n", lo, (unsigned long long)(field >> lo));
+  for (int g = 0; g < nr_group; g ++) {
+    if (g == dflt) continue;
+    int col = 0;
+    for (int v = 0; v < nr_val; v ++) {
+      if (group[v] != g) continue;
+      if (col == 0) indent(level + 1);
+      else printf(" ");
+      printf("case 0x%x:", v);
+      if (++ col == 8) { printf("\n"); col = 0; }
+    }
+    if (col != 0) printf("\n");
+    int u = leader[g];
+    gen_node(&sub[u * n], nr_sub[u], tested | field, level + 2);
+  }
+  indent(level + 1);
+  printf("default:\n");
+  int u = leader[dflt];
+  gen_node(&sub[u * n], nr_sub[u], tested | field, level + 2);
+  indent(level);
+  printf("}\n");
+
+  free(sub); free(nr_sub); free(group); free(leader); free(size);
+}
+
+/* `list` holds the patterns in their original order which are consistent
+ * with the bits tested so far. */
+static void gen_node(int *list, int n, uint64_t tested, int level) {
+  if (n == 0) {
+    indent(level);
+    printf("return -1;\n");
+    return;
+  }
+
+  // the first candidate wins once all bits it cares about are tested
+  Pattern *first = &pat[list[0]];
+  uint64_t untested = first->mask & ~tested;
+  if (untested == 0) {
+    indent(level);
+    printf("return %d; // %s\n", first->line, first->name);
+    return;
+  }
+
+  // prefer the bits which all overlapping candidates care about
+  uint64_t common = untested;
+  for (int i = 1; i < n; i ++) {
+    uint64_t m = pat[list[i]].mask;
+    if ((m & untested) != 0 && (common & m) != 0) common &= m;
+  }
+
+  gen_switch(list, n, tested, lowest_run(common), level);
+}
+
+static void gen_table() {
+  static int list[MAX_PAT];
+  for (int i = 0; i < nr_pat; i ++) list[i] = i;
+
+  printf("\nstatic inline int __instpat_tree_%s(uint64_t inst) {\n", table_name);
+  gen_node(list, nr_pat, 0, 1);
+  printf("}\n");
+}
+
+int main(int argc, char *argv[]) {
+  input = read_all(stdin);
+  p = input;
+
+  printf("// generated by tools/gen-decode, do not edit\n");
+  printf("#include <stdint.h>\n");
+
+  bool in_table = false;
+  while (*p != '\0') {
+    if (!(isalpha(*p) || *p == '_')) { p ++; continue; }
+    char ident[64];
+    read_ident(ident, sizeof(ident));
+
+    if (strcmp(ident, "__instpat_start__") == 0) {
+      if (in_table) die("nested INSTPAT_START");
+      expect('(');
+      read_ident(table_name, sizeof(table_name));
+      expect(')');
+      in_table = true;
+      nr_pat = 0;
+    } else if (strcmp(ident, "__instpat__") == 0) {
+      if (!in_table) die("INSTPAT outside INSTPAT_START/INSTPAT_END");
+      char str[256], name[64];
+      expect('(');
+      read_string(str, sizeof(str));
+      expect(',');
+      read_string(name, sizeof(name));
+      expect(',');
+      int line = read_int();
+      expect(')');
+      add_pattern(str, name, line);
+    } else if (strcmp(ident, "__instpat_end__") == 0) {
+      if (!in_table) die("INSTPAT_END without INSTPAT_START");
+      gen_table();
+      in_table = false;
+    }
+  }
+  if (in_table) die("missing INSTPAT_END");
+
+  printf("\n#define __instpat_line_ok(l) (0");
+  for (int i = 0; i < nr_all_line; i ++) {
+    printf("%s || (l) == %d", (i % 8 == 0 ? " \\\n " : ""), all_line[i]);
+  }
+  printf(")\n");
+
+  free(input);
+  return 0;
+}
@@ -0,0 +1 @@
+../../src/utils/disasm.c
\ No newline at end of file
@@ -0,0 +1,172 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+/* Print the records of a file written by `nemu --itrace=FILE`.
+ *
+ *   itrace-dump FILE [N [COUNT]]
+ *
+ * prints COUNT (default: all) records from the first instruction numbered
+ * N or later. The block holding N is found by binary search in the index,
+ * so only the blocks printed are decompressed. The instructions are
+ * disassembled as in the log, and the calls and returns recorded by ftrace
+ * are printed before the instructions making them.
+ */
+
+#include <itrace-file.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+static FILE *fp = NULL;
+static ItraceIndexEntry *idx = NULL;
+static uint64_t nr_block = 0;
+static char **func_name = NULL;
+static uint64_t nr_func = 0;
+static bool is_x86 = false;
+
+bool init_disasm(const char *isa);
+void disassemble(char *str, int size, uint64_t pc, uint8_t *code, int nbyte);
+
+static void die(const char *msg) {
+  fprintf(stderr, "itrace-dump: %s\n", msg);
+  exit(1);
+}
+
+static void read_at(void *buf, size_t size, uint64_t off) {
+  if (fseeko(fp, off, SEEK_SET) != 0 || fread(buf, size, 1, fp) != 1) die("broken itrace file");
+}
+
+static void open_trace(const char *file) {
+  fp = fopen(file, "rb");
+  if (fp == NULL) die("can not open the file");
+
+  ItraceFileHeader h;
+  read_at(&h, sizeof(h), 0);
+  if (memcmp(h.magic, ITRACE_FILE_MAGIC, sizeof(ITRACE_FILE_MAGIC)) != 0) die("not an itrace file");
+  if (h.version != ITRACE_FILE_VERSION || h.record_size != sizeof(ItraceRecord)) {
+    die("unsupported version of itrace file");
+  }
+  h.isa[sizeof(h.isa) - 1] = '\0';
+  is_x86 = strcmp(h.isa, "x86") == 0;
+  if (!init_disasm(h.isa)) die("can not load the disassembler, is NEMU_HOME set?");
+
+  ItraceFileFooter f;
+  if (fseeko(fp, -(off_t)sizeof(f), SEEK_END) != 0 || fread(&f, sizeof(f), 1, fp) != 1 ||
+      memcmp(f.magic, ITRACE_FILE_MAGIC, sizeof(ITRACE_FILE_MAGIC)) != 0) {
+    die("the itrace file is not closed properly");
+  }
+  // the names lie between the index and the footer
+  off_t end = ftello(fp) - sizeof(f);
+  nr_block = f.nr_block;
+  idx = malloc(sizeof(ItraceIndexEntry) * (nr_block + 1));
+  if (idx == NULL) die("out of memory");
+  if (nr_block > 0) read_at(idx, sizeof(ItraceIndexEntry) * nr_block, f.index_offset);
+
+  if (end < 0 || (uint64_t)end < f.func_offset) die("broken itrace file");
+  size_t size = end - f.func_offset;
+  char *names = malloc(size + 1);
+  nr_func = f.nr_func;
+  func_name = malloc(sizeof(char *) * (nr_func + 1));
+  if (names == NULL || func_name == NULL) die("out of memory");
+  if (size > 0) read_at(names, size, f.func_offset);
+  names[size] = '\0';
+  char *p = names;
+  for (uint64_t i = 0; i < nr_func; i ++) {
+    if (p >= names + size) die("broken itrace file");
+    func_name[i] = p;
+    p += strlen(p) + 1;
+  }
+}
+
+// the last block starting at or before instruction n
+static uint64_t find_block(uint64_t n) {
+  uint64_t l = 0, r = nr_block;
+  while (l < r) {
+    uint64_t m = (l + r) / 2;
+    if (idx[m].first_inst <= n) l = m + 1;
+    else r = m;
+  }
+  return (l > 0 ? l - 1 : 0);
+}
+
+static int read_block(uint64_t i, ItraceRecord *rec) {
+  static uint8_t buf[ITRACE_BLOCK_RECORDS * sizeof(ItraceRecord)];
+  ItraceBlockHeader h;
+  read_at(&h, sizeof(h), idx[i].offset);
+  size_t raw = h.nr_record * sizeof(ItraceRecord);
+  if (h.nr_record > ITRACE_BLOCK_RECORDS || h.size > raw) die("broken itrace file");
+  if (h.size == raw) {
+    read_at(rec, raw, idx[i].offset + sizeof(h));
+  } else {
+    read_at(buf, h.size, idx[i].offset + sizeof(h));
+    if (lz_decompress(buf, h.size, rec, raw) != raw) die("broken block");
+  }
+  return h.nr_record;
+}
+
+static const char *func(uint32_t i) {
+  return (i < nr_func ? func_name[i] : "???");
+}
+
+// the same as itrace_format()
+static void print_inst(const ItraceRecord *r) {
+  int ilen = (r->ilen < ITRACE_MAX_ILEN ? r->ilen : ITRACE_MAX_ILEN);
+  for (int i = 0; i < ilen; i ++) printf(" %02x", r->inst[is_x86 ? i : ilen - 1 - i]);
+  int space_len = (is_x86 ? 8 : 4) - ilen;
+  if (space_len < 0) space_len = 0;
+  printf("%*s", space_len * 3 + 1, "");
+
+  char buf[128];
+  disassemble(buf, sizeof(buf), is_x86 ? r->pc + ilen : r->pc, (uint8_t *)r->inst, ilen);
+  printf("%s\n", buf);
+}
+
+static void print_record(uint64_t n, const ItraceRecord *r) {
+  printf("%" PRIu64 "\t0x%08" PRIx64 ":", n, r->pc);
+  switch (r->kind) {
+    case ITRACE_REC_INST: print_inst(r); break;
+    case ITRACE_REC_CALL:
+      printf(" call[%s@0x%08" PRIx64 "]\n", func(r->fn.func), r->fn.target); break;
+    case ITRACE_REC_RET:
+      printf(" ret[%s]\n", func(r->fn.func)); break;
+    default: die("broken record");
+  }
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2 || argc > 4) {
+    fprintf(stderr, "Usage: %s FILE [N [COUNT]]\n", argv[0]);
+    return 1;
+  }
+  open_trace(argv[1]);
+  uint64_t start = (argc > 2 ? strtoull(argv[2], NULL, 0) : 0);
+  uint64_t count = (argc > 3 ? strtoull(argv[3], NULL, 0) : UINT64_MAX);
+
+  static ItraceRecord rec[ITRACE_BLOCK_RECORDS];
+  for (uint64_t b = find_block(start); b < nr_block && count > 0; b ++) {
+    int n = read_block(b, rec);
+    uint64_t nr_inst = idx[b].first_inst;
+    for (int i = 0; i < n && count > 0; i ++) {
+      if (i > 0) nr_inst += rec[i].delta;
+      if (nr_inst >= start) {
+        print_record(nr_inst, &rec[i]);
+        count --;
+      }
+    }
+  }
+  return 0;
+}
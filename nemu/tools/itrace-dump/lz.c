@@ -0,0 +1 @@
+../../src/utils/lz.c
\ No newline at end of file